@@ -0,0 +1,1251 @@
+// standalone benchmarks, one json object per line on stdout
+//   cc -O2 -I. -o bench bench.c modbus/*.c && ./bench [seconds per case]
+// built with -DMODBUS_CAPTURE a capture file given after the seconds is
+// replayed through both parsers as well, rtu frames at the baud given after
+// it or 9600; exits non-zero when a correctness check fails
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "modbus/crc.h"
+#include "modbus/modbus.h"
+#include "modbus/server.h"
+#include "modbus/sim.h"
+
+#define BENCH_WIRE_SIZE (512)
+
+static uint64_t bench_allocs;
+static uint64_t bench_min_ns = 200000000ULL;
+// while set, time is the virtual clock of the simulated line
+static modbus_sim_t *bench_sim;
+
+void *modbus_arch_malloc(int size) {
+  bench_allocs++;
+  return malloc(size);
+}
+void modbus_arch_free(void *ptr) { free(ptr); }
+void modbus_arch_memset(void *s, int c, int l) { memset(s, c, l); }
+void modbus_arch_memcpy(void *d, void *s, int l) { memcpy(d, s, l); }
+uint16_t modbus_arch_htons(uint16_t v) { return htons(v); }
+uint32_t modbus_arch_millis(void) {
+  if (bench_sim) return modbus_sim_millis(bench_sim);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+#if defined(MODBUS_STATS) || defined(MODBUS_CAPTURE)
+uint32_t modbus_arch_micros(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#endif
+
+static uint64_t bench_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+typedef struct {
+  uint64_t iters;
+  uint64_t ns;
+  uint64_t allocs;
+} bench_result_t;
+
+// runs fn in batches until the minimum time per case elapsed
+static void bench_run(void (*fn)(void *arg), void *arg, bench_result_t *r) {
+  uint64_t allocs = bench_allocs;
+  uint64_t start = bench_clock();
+  uint64_t now = start;
+
+  r->iters = 0;
+  while (now - start < bench_min_ns) {
+    for (int i = 0; i < 64; i++) {
+      fn(arg);
+    }
+    r->iters += 64;
+    now = bench_clock();
+  }
+
+  r->ns = now - start;
+  r->allocs = bench_allocs - allocs;
+}
+
+static void bench_report(const char *suite, const char *name,
+                         bench_result_t *r, int bytes) {
+  double ns = (double)r->ns / r->iters;
+
+  printf("{\"suite\":\"%s\",\"name\":\"%s\",\"iters\":%llu", suite, name,
+         (unsigned long long)r->iters);
+  printf(",\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f", ns, 1e9 / ns);
+  printf(",\"allocs_per_op\":%.3f", (double)r->allocs / r->iters);
+  if (bytes) {
+    printf(",\"bytes\":%d,\"mb_per_sec\":%.1f", bytes, bytes * 1e3 / ns);
+  }
+  printf("}\n");
+}
+
+// in-memory loopback, recv replays rx from the start of each round and
+// send keeps the last frame written
+typedef struct {
+  uint8_t rx[BENCH_WIRE_SIZE];
+  int rx_len;
+  int rx_pos;
+  // bytes handed out per recv, 0 for everything available
+  int rx_step;
+  uint8_t tx[BENCH_WIRE_SIZE];
+  int tx_len;
+} bench_wire_t;
+
+typedef struct {
+  modbus_driver_rtu_t driver;
+  bench_wire_t wire;
+} bench_rtu_t;
+
+typedef struct {
+  modbus_driver_socket_t driver;
+  bench_wire_t wire;
+  uint8_t cache[MODBUS_PAYLOAD_BUFFER_SIZE + 16];
+} bench_socket_t;
+
+static int wire_recv(bench_wire_t *w, uint8_t *buf, int max) {
+  int len = w->rx_len - w->rx_pos;
+  if (len > max) len = max;
+  if (w->rx_step && len > w->rx_step) len = w->rx_step;
+
+  memcpy(buf, &w->rx[w->rx_pos], len);
+  w->rx_pos += len;
+  return len;
+}
+
+static int wire_send(bench_wire_t *w, uint8_t *buf, int len) {
+  if (w->tx_len + len > BENCH_WIRE_SIZE) {
+    w->tx_len = 0;
+  }
+
+  memcpy(&w->tx[w->tx_len], buf, len);
+  w->tx_len += len;
+  return len;
+}
+
+static void rtu_init(void *this) {
+  bench_rtu_t *d = this;
+  modbus_buffer_init(&d->driver.inbuf, BENCH_WIRE_SIZE);
+  modbus_buffer_init(&d->driver.oubuf, BENCH_WIRE_SIZE);
+}
+
+static void rtu_kill(void *this) {
+  bench_rtu_t *d = this;
+  modbus_buffer_kill(&d->driver.inbuf);
+  modbus_buffer_kill(&d->driver.oubuf);
+}
+
+static int rtu_recv(void *this, uint8_t *buf, int max) {
+  return wire_recv(&((bench_rtu_t *)this)->wire, buf, max);
+}
+
+static int rtu_send(void *this, uint8_t *buf, int len) {
+  return wire_send(&((bench_rtu_t *)this)->wire, buf, len);
+}
+
+static void socket_init(void *this) {
+  bench_socket_t *d = this;
+  modbus_buffer_init(&d->driver.inbuf, BENCH_WIRE_SIZE);
+  d->driver.cache = d->cache;
+  d->driver.cache_len = sizeof(d->cache);
+}
+
+static void socket_kill(void *this) {
+  bench_socket_t *d = this;
+  modbus_buffer_kill(&d->driver.inbuf);
+}
+
+static int socket_recv(void *this, uint8_t *buf, int max) {
+  return wire_recv(&((bench_socket_t *)this)->wire, buf, max);
+}
+
+static int socket_send(void *this, uint8_t *buf, int len) {
+  return wire_send(&((bench_socket_t *)this)->wire, buf, len);
+}
+
+typedef struct {
+  modbus_t slave;
+  modbus_t master;
+  bench_wire_t *slave_wire;
+  bench_wire_t *master_wire;
+  modbus_mbap_t slave_mbap;
+  modbus_mbap_t master_mbap;
+  modbus_inflight_t inflight[4];
+  modbus_request_t req;
+  bool socket;
+} bench_pair_t;
+
+static uint8_t bench_coils[16];
+static uint8_t bench_inputs[16];
+static uint16_t bench_holding[128];
+static uint16_t bench_registers[128];
+static modbus_model_t bench_model;
+// file records of every file map onto one table, served by the hooks of
+// the slave in bench_file_slave
+static uint16_t bench_records[128];
+static modbus_t *bench_file_slave;
+
+static void file_read(uint8_t addr, void *arg) {
+  modbus_request_t *req = arg;
+  modbus_file_record_t rec;
+  modbus_reply_t rep;
+  int pos = 0;
+
+  modbus_reply_init(&rep, req);
+  while (modbus_file_next(&req->payload, req->opcode, false, &pos, &rec)) {
+    if (rec.record + rec.length > 128 ||
+        !modbus_file_append(&rep.payload, req->opcode, true, &rec,
+                            &bench_records[rec.record])) {
+      modbus_reply_free(&rep);
+      modbus_error_init(&rep, req, MODBUS_EXCEPTION_ILLEGAL_ADDRESS);
+      break;
+    }
+  }
+
+  modbus_reply_send(&rep, addr, bench_file_slave);
+  modbus_reply_free(&rep);
+}
+
+static void file_write(uint8_t addr, void *arg) {
+  modbus_request_t *req = arg;
+  modbus_file_record_t rec;
+  modbus_reply_t rep;
+  int pos = 0;
+
+  while (modbus_file_next(&req->payload, req->opcode, false, &pos, &rec)) {
+    if (rec.record + rec.length <= 128) {
+      modbus_file_load(&rec, &bench_records[rec.record]);
+    }
+  }
+
+  modbus_file_echo(&rep, req);
+  modbus_reply_send(&rep, addr, bench_file_slave);
+  modbus_reply_free(&rep);
+}
+
+static void frame_slave(void *arg) {
+  bench_pair_t *b = arg;
+  b->slave_wire->rx_pos = 0;
+  b->slave_wire->tx_len = 0;
+
+  // a slow line delivers a few bytes per idle call
+  do {
+    modbus_idle(&b->slave);
+  } while (b->slave_wire->rx_pos < b->slave_wire->rx_len);
+}
+
+static void frame_master(void *arg) {
+  bench_pair_t *b = arg;
+  b->master_wire->tx_len = 0;
+  b->master_wire->rx_pos = 0;
+  modbus_request_send(&b->req, 1, &b->master);
+
+  // the reply has to carry the id of the request just sent
+  if (b->socket) {
+    b->master_wire->rx[0] = b->master_mbap.transaction >> 8;
+    b->master_wire->rx[1] = b->master_mbap.transaction;
+  }
+  modbus_idle(&b->master);
+}
+
+static void frame_request(modbus_request_t *req, uint8_t opcode,
+                          modbus_t *m) {
+  modbus_request_init_pool(req, opcode, m);
+  req->address = 4;
+  req->length = 10;
+
+  if (opcode == MODBUS_OPCODE_WRITE_COIL) {
+    req->length = MODBUS_WRITE_COIL_TRUE;
+  }
+
+  if (opcode == MODBUS_OPCODE_WRITE_REGISTER) {
+    req->length = 0x1234;
+  }
+
+  if (opcode == MODBUS_OPCODE_WRITE_COILS) {
+    req->length = 16;
+    req->payload.length = 2;
+    req->payload.u8[0] = 0xA5;
+    req->payload.u8[1] = 0x5A;
+  }
+
+  if (opcode == MODBUS_OPCODE_WRITE_REGISTERS) {
+    req->payload.length = req->length * 2;
+    for (int i = 0; i < req->length; i++) {
+      req->payload.u16[i] = 0x100 + i;
+    }
+  }
+
+  if (opcode == MODBUS_OPCODE_MASK_WRITE_REGISTER) {
+    req->and_mask = 0x00F2;
+    req->or_mask = 0x0025;
+  }
+
+  // one sub-request of the same range in file 1
+  if (opcode == MODBUS_OPCODE_READ_FILE_RECORD ||
+      opcode == MODBUS_OPCODE_WRITE_FILE_RECORD) {
+    modbus_file_record_t rec = {
+        .file = 1, .record = req->address, .length = req->length};
+    uint16_t regs[10];
+    for (int i = 0; i < 10; i++) {
+      regs[i] = 0x300 + i;
+    }
+    modbus_file_append(&req->payload, opcode, false, &rec, regs);
+  }
+
+  if (opcode == MODBUS_OPCODE_READ_WRITE_REGISTERS) {
+    req->write_address = 20;
+    req->write_length = 10;
+    req->payload.length = req->write_length * 2;
+    for (int i = 0; i < req->write_length; i++) {
+      req->payload.u16[i] = 0x200 + i;
+    }
+  }
+}
+
+static void bench_frames(bool socket, uint8_t flag) {
+  static const uint8_t opcodes[] = {
+      MODBUS_OPCODE_READ_COILS,       MODBUS_OPCODE_DISCRETE_INPUTS,
+      MODBUS_OPCODE_READ_HOLDING_REGISTERS,
+      MODBUS_OPCODE_READ_INPUT_REGISTERS,
+      MODBUS_OPCODE_WRITE_COIL,       MODBUS_OPCODE_WRITE_REGISTER,
+      MODBUS_OPCODE_WRITE_COILS,      MODBUS_OPCODE_WRITE_REGISTERS,
+      MODBUS_OPCODE_MASK_WRITE_REGISTER,
+      MODBUS_OPCODE_READ_FILE_RECORD, MODBUS_OPCODE_WRITE_FILE_RECORD,
+      MODBUS_OPCODE_READ_WRITE_REGISTERS,
+  };
+
+  const char *parser = socket ? "socket" : "rtu";
+  const char *mode = flag ? "/view" : "";
+
+  for (int i = 0; i < (int)sizeof(opcodes); i++) {
+    bench_pair_t b;
+    bench_rtu_t rtu[2];
+    bench_socket_t sock[2];
+    memset(&b, 0, sizeof(b));
+    memset(rtu, 0, sizeof(rtu));
+    memset(sock, 0, sizeof(sock));
+
+    b.socket = socket;
+    b.slave.role = MODBUS_ROLE_SLAVE;
+    b.slave.flag = flag;
+    b.slave.slave.addr = 1;
+    b.slave.slave.model = &bench_model;
+    b.slave.hooks.read_file_record = file_read;
+    b.slave.hooks.write_file_record = file_write;
+    b.master.role = MODBUS_ROLE_MASTER;
+    bench_file_slave = &b.slave;
+
+    if (socket) {
+      for (int k = 0; k < 2; k++) {
+        sock[k].driver.init = socket_init;
+        sock[k].driver.kill = socket_kill;
+        sock[k].driver.recv = socket_recv;
+        sock[k].driver.send = socket_send;
+      }
+      b.master_mbap.inflight = b.inflight;
+      b.master_mbap.inflight_len = 4;
+      b.slave.parser = &modbus_parser_socket;
+      b.slave.driver = &sock[0];
+      b.slave.extra = &b.slave_mbap;
+      b.slave_wire = &sock[0].wire;
+      b.master.parser = &modbus_parser_socket;
+      b.master.driver = &sock[1];
+      b.master.extra = &b.master_mbap;
+      b.master_wire = &sock[1].wire;
+    } else {
+      for (int k = 0; k < 2; k++) {
+        rtu[k].driver.init = rtu_init;
+        rtu[k].driver.kill = rtu_kill;
+        rtu[k].driver.recv = rtu_recv;
+        rtu[k].driver.send = rtu_send;
+      }
+      b.slave.parser = &modbus_parser_rtu;
+      b.slave.driver = &rtu[0];
+      b.slave_wire = &rtu[0].wire;
+      b.master.parser = &modbus_parser_rtu;
+      b.master.driver = &rtu[1];
+      b.master_wire = &rtu[1].wire;
+    }
+
+    modbus_init(&b.slave);
+    modbus_init(&b.master);
+
+    // capture one request and its reply, then replay them; rtu drivers
+    // flush their output buffer on the following idle
+    frame_request(&b.req, opcodes[i], &b.master);
+    modbus_request_send(&b.req, 1, &b.master);
+    modbus_idle(&b.master);
+    memcpy(b.slave_wire->rx, b.master_wire->tx, b.master_wire->tx_len);
+    b.slave_wire->rx_len = b.master_wire->tx_len;
+    frame_slave(&b);
+    modbus_idle(&b.slave);
+    memcpy(b.master_wire->rx, b.slave_wire->tx, b.slave_wire->tx_len);
+    b.master_wire->rx_len = b.slave_wire->tx_len;
+    modbus_idle(&b.master);
+
+    if (b.slave_wire->tx_len == 0) {
+      fprintf(stderr, "%s fc%02x: no reply\n", parser, opcodes[i]);
+      exit(1);
+    }
+
+    char name[64];
+    bench_result_t r;
+
+    bench_run(frame_slave, &b, &r);
+    snprintf(name, sizeof(name), "%s/slave/fc%02x%s", parser, opcodes[i],
+             mode);
+    bench_report("frame", name, &r, b.slave_wire->rx_len);
+
+    if (!flag) {
+      b.slave_wire->rx_step = 1;
+      bench_run(frame_slave, &b, &r);
+      snprintf(name, sizeof(name), "%s/slave/fc%02x/trickle", parser,
+               opcodes[i]);
+      bench_report("frame", name, &r, b.slave_wire->rx_len);
+      b.slave_wire->rx_step = 0;
+
+      bench_run(frame_master, &b, &r);
+      snprintf(name, sizeof(name), "%s/master/fc%02x", parser, opcodes[i]);
+      bench_report("frame", name, &r, b.master_wire->rx_len);
+    }
+
+    modbus_request_free(&b.req);
+    modbus_kill(&b.slave);
+    modbus_kill(&b.master);
+  }
+}
+
+typedef struct {
+  uint16_t (*fn)(uint16_t crc, uint8_t *buf, int len);
+  uint8_t *buf;
+  int len;
+  uint16_t crc;
+} bench_crc_t;
+
+static void crc_run(void *arg) {
+  bench_crc_t *c = arg;
+  c->crc ^= c->fn(MODBUS_CRC16_INIT, c->buf, c->len);
+}
+
+static void bench_crc(void) {
+  static uint8_t buf[4096];
+  static const int sizes[] = {8, 64, 256, 4096};
+  struct {
+    const char *name;
+    uint16_t (*fn)(uint16_t crc, uint8_t *buf, int len);
+  } engines[] = {
+      {"bitwise", modbus_crc16_bitwise},
+      {"table", modbus_crc16_table},
+      {"slice8", modbus_crc16_slice8},
+#if MODBUS_CRC16_HAS_CLMUL
+      {"clmul", modbus_crc16_clmul},
+#endif
+      {"default", modbus_crc16},
+  };
+
+  for (int i = 0; i < (int)sizeof(buf); i++) {
+    buf[i] = i * 31 + 7;
+  }
+
+  for (int e = 0; e < (int)(sizeof(engines) / sizeof(engines[0])); e++) {
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+      bench_crc_t c = {engines[e].fn, buf, sizes[s], 0};
+      bench_result_t r;
+      char name[64];
+
+      bench_run(crc_run, &c, &r);
+      snprintf(name, sizeof(name), "%s/%d", engines[e].name, sizes[s]);
+      bench_report("crc16", name, &r, sizes[s]);
+    }
+  }
+}
+
+// every engine must agree with the bitwise reference
+static bool bench_crc_check(void) {
+  static uint8_t buf[300];
+  uint16_t (*engines[])(uint16_t crc, uint8_t *buf, int len) = {
+      modbus_crc16_table,
+      modbus_crc16_slice8,
+#if MODBUS_CRC16_HAS_CLMUL
+      modbus_crc16_clmul,
+#endif
+      modbus_crc16,
+  };
+
+  srand(1);
+  for (int round = 0; round < 64; round++) {
+    for (int i = 0; i < (int)sizeof(buf); i++) {
+      buf[i] = rand();
+    }
+
+    for (int len = 0; len <= (int)sizeof(buf); len++) {
+      uint16_t crc = rand();
+      uint16_t want = modbus_crc16_bitwise(crc, buf, len);
+
+      for (int e = 0; e < (int)(sizeof(engines) / sizeof(engines[0])); e++) {
+        if (engines[e](crc, buf, len) != want) {
+          fprintf(stderr, "crc16 engine %d differs at length %d\n", e, len);
+          return false;
+        }
+      }
+    }
+  }
+
+  return true;
+}
+
+typedef struct {
+  modbus_buffer_t b;
+  uint8_t raw[4096];
+  uint16_t regs[2048];
+  int len;
+} bench_buffer_t;
+
+static void buffer_bytes(void *arg) {
+  bench_buffer_t *c = arg;
+  modbus_buffer_write(&c->b, c->raw, c->len);
+  modbus_buffer_read(&c->b, c->raw, c->len);
+}
+
+static void buffer_u16s(void *arg) {
+  bench_buffer_t *c = arg;
+  modbus_buffer_write_u16s(&c->b, c->regs, c->len / 2, true);
+  modbus_buffer_read_u16s(&c->b, c->regs, c->len / 2, true);
+}
+
+static void bench_buffer(void) {
+  static const int capacities[] = {64, 260, 256, 4096};
+  static bench_buffer_t c;
+
+  for (int i = 0; i < (int)(sizeof(capacities) / sizeof(capacities[0]));
+       i++) {
+    int capacity = capacities[i];
+
+    // start of the ring, middle and just before the end so every
+    // transfer of half the capacity wraps
+    int positions[] = {0, capacity / 2, capacity - 1};
+    for (int p = 0; p < 3; p++) {
+      bench_result_t r;
+      char name[64];
+
+      modbus_buffer_init(&c.b, capacity);
+      c.len = capacity / 2;
+      modbus_buffer_write(&c.b, c.raw, positions[p]);
+      modbus_buffer_skip(&c.b, positions[p]);
+
+      bench_run(buffer_bytes, &c, &r);
+      snprintf(name, sizeof(name), "bytes/%d@%d", capacity, positions[p]);
+      bench_report("buffer", name, &r, c.len);
+
+      bench_run(buffer_u16s, &c, &r);
+      snprintf(name, sizeof(name), "u16s/%d@%d", capacity, positions[p]);
+      bench_report("buffer", name, &r, c.len & ~1);
+
+      modbus_buffer_kill(&c.b);
+    }
+  }
+}
+
+typedef struct {
+  modbus_t slave;
+  bench_rtu_t rtu;
+  uint32_t seed;
+  int noise;
+  int frame_len;
+  uint8_t frame[16];
+  uint64_t recovered;
+} bench_resync_t;
+
+static void resync_run(void *arg) {
+  bench_resync_t *c = arg;
+  bench_wire_t *w = &c->rtu.wire;
+
+  for (int i = 0; i < c->noise; i++) {
+    c->seed = c->seed * 1103515245 + 12345;
+    w->rx[i] = c->seed >> 16;
+  }
+
+  memcpy(&w->rx[c->noise], c->frame, c->frame_len);
+  w->rx_len = c->noise + c->frame_len;
+  w->rx_pos = 0;
+  w->tx_len = 0;
+
+  // noise that looks like the start of a long frame holds the stream
+  // until more bytes arrive, start every round from a clean buffer
+  modbus_buffer_skip(&c->rtu.driver.inbuf,
+                     modbus_buffer_length(&c->rtu.driver.inbuf));
+  memset(&c->rtu.driver.decoder, 0, sizeof(modbus_decoder_t));
+  modbus_idle(&c->slave);
+  modbus_idle(&c->slave);
+
+  if (w->tx_len) {
+    c->recovered++;
+  }
+}
+
+// garbage followed by one valid request, the request has to be found
+static void bench_resync(void) {
+  static const int noises[] = {16, 64, 256};
+  static bench_resync_t c;
+
+  for (int n = 0; n < 3; n++) {
+    memset(&c, 0, sizeof(c));
+    c.rtu.driver.init = rtu_init;
+    c.rtu.driver.kill = rtu_kill;
+    c.rtu.driver.recv = rtu_recv;
+    c.rtu.driver.send = rtu_send;
+    c.slave.role = MODBUS_ROLE_SLAVE;
+    c.slave.parser = &modbus_parser_rtu;
+    c.slave.driver = &c.rtu;
+    c.slave.slave.addr = 1;
+    c.slave.slave.model = &bench_model;
+    c.seed = 2024;
+    c.noise = noises[n];
+
+    uint8_t frame[] = {1, MODBUS_OPCODE_READ_HOLDING_REGISTERS, 0, 4, 0, 10};
+    uint16_t crc16 = modbus_crc16(MODBUS_CRC16_INIT, frame, sizeof(frame));
+    memcpy(c.frame, frame, sizeof(frame));
+    c.frame[6] = crc16;
+    c.frame[7] = crc16 >> 8;
+    c.frame_len = 8;
+
+    modbus_init(&c.slave);
+
+    bench_result_t r;
+    char name[64];
+    bench_run(resync_run, &c, &r);
+    snprintf(name, sizeof(name), "rtu/noise/%d", c.noise);
+    bench_report("resync", name, &r, c.noise + c.frame_len);
+    printf("{\"suite\":\"resync\",\"name\":\"%s/recovery\"", name);
+    printf(",\"ns_per_noise_byte\":%.2f,\"recovered\":%.4f}\n",
+           (double)r.ns / r.iters / c.noise, (double)c.recovered / r.iters);
+
+    modbus_kill(&c.slave);
+  }
+}
+
+#define BENCH_SIM_TRANSACTIONS (200)
+
+typedef struct {
+  modbus_sim_t sim;
+  modbus_t slave;
+  modbus_t master;
+  modbus_master_t engine;
+  modbus_job_t jobs[4];
+  uint64_t sent;
+  uint64_t latency;
+  int replies;
+  int timeouts;
+  int errors;
+} bench_line_t;
+
+static void line_done(void *arg, uint8_t status, uint8_t addr,
+                      modbus_reply_t *rep) {
+  bench_line_t *c = arg;
+  c->latency += c->sim.now - c->sent;
+
+  if (status != MODBUS_DONE_REPLY) {
+    c->timeouts++;
+  } else if (rep->payload.length != 20 ||
+             memcmp(rep->payload.u16, bench_holding, 20)) {
+    c->errors++;
+  } else {
+    c->replies++;
+  }
+}
+
+// fc03 transactions one after the other between a master and a slave on a
+// simulated 9600 8E1 line, with the t3.5 framing the sim drives and without
+// it, over a clean and a noisy line; figures are virtual time
+static bool bench_line(void) {
+  static bench_line_t c;
+  bool ok = true;
+
+  for (int k = 0; k < 4; k++) {
+    bool timed = k & 1;
+    bool noisy = k & 2;
+
+    modbus_sim_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.baud = 9600;
+    config.parity = MODBUS_SIM_PARITY_EVEN;
+    config.seed = 2024;
+    if (noisy) {
+      config.noise_ppm = 2000;
+      config.drop_ppm = 1000;
+      config.gap_ppm = 2000;
+      config.gap_us = 5000;
+    }
+
+    memset(&c, 0, sizeof(c));
+    modbus_sim_init(&c.sim, &config);
+    if (!timed) {
+      c.sim.a.driver.silence = 0;
+      c.sim.b.driver.silence = 0;
+    }
+
+    c.slave.role = MODBUS_ROLE_SLAVE;
+    c.slave.parser = &modbus_parser_rtu;
+    c.slave.driver = &c.sim.a;
+    c.slave.slave.addr = 1;
+    c.slave.slave.model = &bench_model;
+    modbus_master_init(&c.engine, c.jobs, 4);
+    c.engine.timeout = 200;
+    c.master.role = MODBUS_ROLE_MASTER;
+    c.master.parser = &modbus_parser_rtu;
+    c.master.driver = &c.sim.b;
+    c.master.master.engine = &c.engine;
+
+    bench_sim = &c.sim;
+    modbus_init(&c.slave);
+    modbus_init(&c.master);
+
+    for (int i = 0; i < BENCH_SIM_TRANSACTIONS; i++) {
+      modbus_request_t req;
+      modbus_request_init_pool(&req, MODBUS_OPCODE_READ_HOLDING_REGISTERS,
+                               &c.master);
+      req.address = 0;
+      req.length = 10;
+      c.sent = c.sim.now;
+      if (!modbus_master_submit(&c.master, &req, 1, line_done, &c)) {
+        modbus_request_free(&req);
+        break;
+      }
+
+      while (c.engine.count) {
+        modbus_sim_advance(&c.sim, 100);
+        modbus_idle(&c.slave);
+        modbus_idle(&c.master);
+      }
+    }
+
+    modbus_sim_stats_t stats;
+    modbus_sim_stats(&c.sim, &stats);
+    int done = c.replies + c.timeouts + c.errors;
+
+    printf("{\"suite\":\"line\",\"name\":\"rtu/9600/%s%s\"",
+           timed ? "timed" : "untimed", noisy ? "/noise" : "");
+    printf(",\"transactions\":%d,\"replies\":%d,\"timeouts\":%d", done,
+           c.replies, c.timeouts);
+    printf(",\"errors\":%d,\"latency_ms\":%.2f,\"utilization\":%.3f",
+           c.errors, done ? c.latency / 1e3 / done : 0, stats.utilization);
+    printf(",\"dropped\":%llu,\"corrupted\":%llu}\n",
+           (unsigned long long)stats.dropped,
+           (unsigned long long)stats.corrupted);
+
+    // noise may cost replies, never a wrong one
+    if (done != BENCH_SIM_TRANSACTIONS || c.errors ||
+        (!noisy && c.replies != BENCH_SIM_TRANSACTIONS)) {
+      ok = false;
+    }
+
+    modbus_kill(&c.slave);
+    modbus_kill(&c.master);
+    bench_sim = 0;
+  }
+
+  return ok;
+}
+
+// frames needed for a synthetic tag list compared to one read per tag
+static void bench_planner(void) {
+  static modbus_point_t points[400];
+  static modbus_poll_t polls[400];
+  static const uint16_t gaps[] = {0, 8, 16};
+
+  for (int g = 0; g < 3; g++) {
+    uint32_t seed = 12345;
+    for (int i = 0; i < 400; i++) {
+      seed = seed * 1103515245 + 12345;
+      points[i].unit = 1 + (seed >> 16) % 4;
+      points[i].table = MODBUS_OPCODE_READ_HOLDING_REGISTERS;
+      points[i].address = (seed >> 4) % 2000;
+      points[i].count = 1 + (seed >> 24) % 4;
+    }
+
+    modbus_planner_t pl;
+    memset(&pl, 0, sizeof(pl));
+    pl.points = points;
+    pl.points_len = 400;
+    pl.polls = polls;
+    pl.polls_len = 400;
+    pl.gap = gaps[g];
+
+    uint64_t start = bench_clock();
+    bool ok = modbus_planner_plan(&pl);
+    uint64_t ns = bench_clock() - start;
+
+    printf("{\"suite\":\"planner\",\"name\":\"gap/%d\"", gaps[g]);
+    printf(",\"points\":400");
+    printf(",\"frames\":%d,\"saved\":%d,\"plan_ns\":%llu,\"ok\":%s}\n",
+           pl.polls_cnt, modbus_planner_saved(&pl), (unsigned long long)ns,
+           ok ? "true" : "false");
+  }
+}
+
+// a tcp gateway with a reply cache in front of one rtu line, both ends in
+// memory; behaviour is checked first, then the cached path is timed
+typedef struct {
+  modbus_t gateway;
+  modbus_t master;
+  modbus_t slave;
+  bench_socket_t clients[2];
+  modbus_mbap_t mbaps[2];
+  bench_rtu_t line[2];
+  modbus_master_t engine;
+  modbus_job_t jobs[8];
+  modbus_gateway_t g;
+  modbus_gateway_line_t lines[1];
+  modbus_gateway_wait_t waits[8];
+  modbus_gateway_entry_t entries[16];
+  // frames the master put on the line
+  int frames;
+} bench_gateway_t;
+
+// appends what one end sent to the bytes the other end has not read yet
+static void wire_move(bench_wire_t *from, bench_wire_t *to) {
+  int left = to->rx_len - to->rx_pos;
+  memmove(to->rx, &to->rx[to->rx_pos], left);
+  memcpy(&to->rx[left], from->tx, from->tx_len);
+  to->rx_len = left + from->tx_len;
+  to->rx_pos = 0;
+  from->tx_len = 0;
+}
+
+static void gateway_feed(bench_gateway_t *c, int k, uint8_t *frame, int len) {
+  bench_wire_t *w = &c->clients[k].wire;
+  memcpy(w->rx, frame, len);
+  w->rx_len = len;
+  w->rx_pos = 0;
+  w->tx_len = 0;
+
+  c->gateway.driver = &c->clients[k];
+  c->gateway.extra = &c->mbaps[k];
+  modbus_idle(&c->gateway);
+}
+
+// runs the line until the engine has nothing queued, one request and its
+// reply per round
+static void gateway_line(bench_gateway_t *c) {
+  for (int i = 0; i < 16 && (i < 2 || c->engine.count); i++) {
+    modbus_idle(&c->master);
+    if (c->line[0].wire.tx_len) {
+      c->frames++;
+      wire_move(&c->line[0].wire, &c->line[1].wire);
+    }
+
+    modbus_idle(&c->slave);
+    modbus_idle(&c->slave);
+    wire_move(&c->line[1].wire, &c->line[0].wire);
+  }
+}
+
+// client k got one fc03 reply with transaction and the first register
+static bool gateway_reply(bench_gateway_t *c, int k, uint8_t transaction,
+                          uint16_t first) {
+  uint8_t *tx = c->clients[k].wire.tx;
+  return c->clients[k].wire.tx_len == 13 && tx[1] == transaction &&
+         tx[7] == MODBUS_OPCODE_READ_HOLDING_REGISTERS &&
+         (tx[9] << 8 | tx[10]) == first;
+}
+
+static void gateway_hit(void *arg) {
+  bench_gateway_t *c = arg;
+  uint8_t read[] = {0, 1, 0, 0, 0, 6, 5, 3, 0, 2, 0, 2};
+  gateway_feed(c, 0, read, sizeof(read));
+}
+
+static bool bench_gateway(void) {
+  static bench_gateway_t c;
+  memset(&c, 0, sizeof(c));
+
+  for (int k = 0; k < 2; k++) {
+    c.line[k].driver.init = rtu_init;
+    c.line[k].driver.kill = rtu_kill;
+    c.line[k].driver.recv = rtu_recv;
+    c.line[k].driver.send = rtu_send;
+    c.clients[k].driver.init = socket_init;
+    c.clients[k].driver.kill = socket_kill;
+    c.clients[k].driver.recv = socket_recv;
+    c.clients[k].driver.send = socket_send;
+  }
+
+  modbus_master_init(&c.engine, c.jobs, 8);
+  c.master.role = MODBUS_ROLE_MASTER;
+  c.master.parser = &modbus_parser_rtu;
+  c.master.driver = &c.line[0];
+  c.master.master.engine = &c.engine;
+  c.slave.role = MODBUS_ROLE_SLAVE;
+  c.slave.parser = &modbus_parser_rtu;
+  c.slave.driver = &c.line[1];
+  c.slave.slave.addr = 5;
+  c.slave.slave.model = &bench_model;
+
+  c.lines[0] = (modbus_gateway_line_t){&c.master, 1, 247, 4};
+  modbus_gateway_init(&c.g, c.lines, 1, c.waits, 8);
+  modbus_gateway_cache(&c.g, c.entries, 16, 3600000, 0, 0);
+  c.gateway.role = MODBUS_ROLE_SLAVE;
+  c.gateway.parser = &modbus_parser_socket;
+  c.gateway.driver = &c.clients[0];
+  c.gateway.extra = &c.mbaps[0];
+  c.gateway.slave.addr = 1;
+  c.gateway.slave.gateway = &c.g;
+
+  modbus_init(&c.slave);
+  modbus_init(&c.master);
+  modbus_init(&c.gateway);
+  socket_init(&c.clients[1]);
+
+  uint16_t saved = bench_holding[2];
+  uint8_t read[] = {0, 1, 0, 0, 0, 6, 5, 3, 0, 2, 0, 2};
+  uint8_t write[] = {0, 3, 0, 0, 0, 6, 5, 6, 0, 2, 0x42, 0x42};
+  uint8_t other[] = {0, 5, 0, 0, 0, 6, 5, 3, 0, 8, 0, 2};
+  bool ok = true;
+
+  // a miss goes to the line, the same read again is answered from cache
+  gateway_feed(&c, 0, read, sizeof(read));
+  gateway_line(&c);
+  ok &= gateway_reply(&c, 0, 1, bench_holding[2]) && c.frames == 1;
+  read[1] = 2;
+  gateway_feed(&c, 0, read, sizeof(read));
+  ok &= gateway_reply(&c, 0, 2, bench_holding[2]) && c.g.hits == 1;
+  ok &= c.frames == 1;
+
+  // a write to the range drops the entry, the next read sees the new value
+  gateway_feed(&c, 0, write, sizeof(write));
+  gateway_line(&c);
+  ok &= c.clients[0].wire.tx_len == 12 && c.frames == 2;
+  read[1] = 4;
+  gateway_feed(&c, 0, read, sizeof(read));
+  gateway_line(&c);
+  ok &= gateway_reply(&c, 0, 4, 0x4242) && c.frames == 3;
+
+  // two clients asking for the same range before the line runs share one
+  // frame, each reply keeps its own transaction
+  gateway_feed(&c, 0, other, sizeof(other));
+  other[1] = 6;
+  gateway_feed(&c, 1, other, sizeof(other));
+  gateway_line(&c);
+  ok &= gateway_reply(&c, 0, 5, bench_holding[8]);
+  ok &= gateway_reply(&c, 1, 6, bench_holding[8]);
+  ok &= c.frames == 4 && c.g.joined == 1;
+
+  printf("{\"suite\":\"gateway\",\"name\":\"checks\",\"frames\":%d", c.frames);
+  printf(",\"hits\":%u,\"misses\":%u,\"joined\":%u,\"ok\":%s}\n", c.g.hits,
+         c.g.misses, c.g.joined, ok ? "true" : "false");
+
+  bench_result_t r;
+  bench_run(gateway_hit, &c, &r);
+  ok &= gateway_reply(&c, 0, 1, 0x4242) && c.frames == 4;
+  bench_report("gateway", "cache/hit", &r, sizeof(read));
+
+  socket_kill(&c.clients[1]);
+  modbus_kill(&c.gateway);
+  modbus_kill(&c.master);
+  modbus_kill(&c.slave);
+  bench_holding[2] = saved;
+  return ok;
+}
+
+#if defined(__linux__)
+#define BENCH_SERVER_CLIENTS (64)
+#define BENCH_SERVER_DEPTH (256)
+#define BENCH_SERVER_REQUESTS (32768)
+
+// fc03 of 125 registers, the largest reply, so a client that keeps a deep
+// pipeline and reads slowly fills the server socket
+typedef struct {
+  int fd;
+  int sent;
+  int received;
+  int total;
+  int tx_pos;
+  uint8_t tx[12];
+  int rx_len;
+  uint8_t rx[4096];
+} bench_client_t;
+
+static bool client_check(bench_client_t *c, uint8_t *frame) {
+  uint16_t transaction = frame[0] << 8 | frame[1];
+  if (transaction != (uint16_t)c->received || frame[5] != 253 ||
+      frame[6] != 1 || frame[7] != MODBUS_OPCODE_READ_HOLDING_REGISTERS ||
+      frame[8] != 250) {
+    return false;
+  }
+
+  for (int i = 0; i < 125; i++) {
+    uint16_t v = frame[9 + i * 2] << 8 | frame[10 + i * 2];
+    if (v != bench_holding[i]) return false;
+  }
+
+  return true;
+}
+
+// sends while the pipeline has room and reads every fourth round; false on
+// a broken connection or a reply that does not match its request
+static bool client_step(bench_client_t *c, int round, int *errors) {
+  while (c->sent < c->total && c->sent - c->received < BENCH_SERVER_DEPTH) {
+    if (c->tx_pos == 0) {
+      uint8_t q[12] = {c->sent >> 8, c->sent, 0, 0, 0, 6, 1, 3, 0, 0, 0, 125};
+      memcpy(c->tx, q, sizeof(q));
+    }
+
+    int n = send(c->fd, c->tx + c->tx_pos, 12 - c->tx_pos, MSG_NOSIGNAL);
+    if (n < 0 && errno == EAGAIN) break;
+    if (n <= 0) return false;
+
+    c->tx_pos += n;
+    if (c->tx_pos == 12) {
+      c->tx_pos = 0;
+      c->sent++;
+    }
+  }
+
+  if (round & 3) return true;
+
+  int n = recv(c->fd, c->rx + c->rx_len, sizeof(c->rx) - c->rx_len, 0);
+  if (n == 0 || (n < 0 && errno != EAGAIN)) return false;
+  if (n > 0) c->rx_len += n;
+
+  int pos = 0;
+  while (c->rx_len - pos >= 259) {
+    if (!client_check(c, c->rx + pos)) (*errors)++;
+    c->received++;
+    pos += 259;
+  }
+  memmove(c->rx, c->rx + pos, c->rx_len - pos);
+  c->rx_len -= pos;
+  return true;
+}
+
+// many pipelined clients against the epoll server over loopback, in this
+// one thread; replies are checked byte for byte
+static bool bench_server(void) {
+  static const int counts[] = {1, 16, BENCH_SERVER_CLIENTS};
+  static bench_client_t clients[BENCH_SERVER_CLIENTS];
+  static modbus_server_t s;
+  bool ok = true;
+
+  memset(&s, 0, sizeof(s));
+  s.modbus.slave.addr = 1;
+  s.modbus.slave.model = &bench_model;
+  s.send_buffer = 4096;
+  if (!modbus_server_init(&s, 0, BENCH_SERVER_CLIENTS)) {
+    fprintf(stderr, "server suite: no listening socket\n");
+    return false;
+  }
+
+  struct sockaddr_storage bound;
+  socklen_t bound_len = sizeof(bound);
+  getsockname(s.listen_fd, (struct sockaddr *)&bound, &bound_len);
+  uint16_t port = ((struct sockaddr_in *)&bound)->sin_port;
+  if (bound.ss_family == AF_INET6) {
+    port = ((struct sockaddr_in6 *)&bound)->sin6_port;
+  }
+
+  for (int k = 0; k < 3; k++) {
+    int count = counts[k];
+    int errors = 0;
+    int broken = 0;
+    uint64_t deferred = s.deferred;
+
+    for (int i = 0; i < count; i++) {
+      bench_client_t *c = &clients[i];
+      memset(c, 0, sizeof(*c));
+      c->total = BENCH_SERVER_REQUESTS / count;
+
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = port;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+      // small windows on both ends make the server run into a full socket
+      int window = 4096;
+      c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      setsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &window, sizeof(window));
+      if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+          errno != EINPROGRESS) {
+        broken++;
+      }
+    }
+
+    uint64_t start = bench_clock();
+    int done = 0;
+    for (int round = 0; done < count; round++) {
+      modbus_server_poll(&s, 0);
+
+      done = 0;
+      for (int i = 0; i < count; i++) {
+        bench_client_t *c = &clients[i];
+        if (c->fd < 0 || c->received == c->total) {
+          done++;
+        } else if (!client_step(c, round, &errors)) {
+          close(c->fd);
+          c->fd = -1;
+          broken++;
+        }
+      }
+
+      if (bench_clock() - start > 10000000000ULL) break;
+    }
+    uint64_t ns = bench_clock() - start;
+
+    int replies = 0;
+    for (int i = 0; i < count; i++) {
+      replies += clients[i].received;
+      if (clients[i].fd >= 0) close(clients[i].fd);
+    }
+
+    // let the server see every connection close before the next round
+    while (s.connections > 0 && modbus_server_poll(&s, 10) > 0) {
+    }
+
+    printf("{\"suite\":\"server\",\"name\":\"clients/%d\"", count);
+    printf(",\"requests\":%d,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f",
+           replies, (double)ns / replies, replies * 1e9 / ns);
+    printf(",\"deferred\":%llu,\"errors\":%d,\"broken\":%d}\n",
+           (unsigned long long)(s.deferred - deferred), errors, broken);
+
+    if (errors || broken || replies != BENCH_SERVER_REQUESTS / count * count) {
+      ok = false;
+    }
+  }
+
+  modbus_server_kill(&s);
+  return ok;
+}
+#endif
+
+#if defined(MODBUS_CAPTURE)
+typedef struct {
+  modbus_replay_t replay;
+  modbus_mbap_t mbap;
+  modbus_unit_t unit;
+  modbus_unit_t *units[MODBUS_UNIT_MAX];
+  modbus_t slave;
+} bench_replay_t;
+
+static void replay_run(void *arg) {
+  bench_replay_t *c = arg;
+  modbus_replay_rewind(&c->replay);
+
+  while (!modbus_replay_done(&c->replay)) {
+    modbus_idle(&c->slave);
+  }
+  modbus_idle(&c->slave);
+}
+
+// received frames of a recorded capture served by the model at every unit
+// address, one op is a pass over the whole file
+static void bench_replay(const char *path, uint32_t baud) {
+  static const uint8_t kinds[] = {MODBUS_CAPTURE_RTU, MODBUS_CAPTURE_SOCKET};
+  static bench_replay_t c;
+
+  FILE *f = fopen(path, "rb");
+  if (!f) return;
+
+  fseek(f, 0, SEEK_END);
+  long length = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  uint8_t *data = malloc(length);
+  if (!data || fread(data, 1, length, f) != (size_t)length) length = 0;
+  fclose(f);
+
+  for (int k = 0; k < 2; k++) {
+    memset(&c, 0, sizeof(c));
+    if (!modbus_replay_init(&c.replay, kinds[k], data, length, baud,
+                            false)) {
+      break;
+    }
+
+    c.unit.model = &bench_model;
+    for (int i = 1; i < MODBUS_UNIT_MAX; i++) {
+      c.units[i] = &c.unit;
+    }
+
+    c.slave.role = MODBUS_ROLE_SLAVE;
+    c.slave.parser = k ? &modbus_parser_socket : &modbus_parser_rtu;
+    c.slave.driver = &c.replay;
+    c.slave.extra = &c.mbap;
+    c.slave.slave.units = c.units;
+    modbus_init(&c.slave);
+
+    // a capture without frames of this kind is skipped
+    replay_run(&c);
+    uint64_t frames = c.replay.frames;
+    uint64_t bytes = c.replay.received;
+
+    if (frames) {
+      bench_result_t r;
+      bench_run(replay_run, &c, &r);
+      bench_report("replay", k ? "socket" : "rtu", &r, bytes);
+      printf("{\"suite\":\"replay\",\"name\":\"%s/frames\"",
+             k ? "socket" : "rtu");
+      printf(",\"frames\":%llu,\"ns_per_frame\":%.2f}\n",
+             (unsigned long long)frames, (double)r.ns / r.iters / frames);
+    }
+
+    modbus_kill(&c.slave);
+  }
+
+  free(data);
+}
+#endif
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    bench_min_ns = atof(argv[1]) * 1e9;
+  }
+
+  bench_model.coils = (modbus_table_t){0, 128, .bits = bench_coils};
+  bench_model.discrete_inputs = (modbus_table_t){0, 128, .bits = bench_inputs};
+  bench_model.holding_registers =
+      (modbus_table_t){0, 128, .regs = bench_holding};
+  bench_model.input_registers =
+      (modbus_table_t){0, 128, .regs = bench_registers};
+
+  if (!bench_crc_check()) {
+    return 1;
+  }
+
+  bench_frames(false, 0);
+  bench_frames(false, MODBUS_FLAG_DECODE_VIEW);
+  bench_frames(true, 0);
+  bench_frames(true, MODBUS_FLAG_DECODE_VIEW);
+  bench_crc();
+  bench_buffer();
+  bench_resync();
+  if (!bench_line()) {
+    return 1;
+  }
+  bench_planner();
+  if (!bench_gateway()) {
+    return 1;
+  }
+#if defined(__linux__)
+  if (!bench_server()) {
+    return 1;
+  }
+#endif
+#if defined(MODBUS_CAPTURE)
+  if (argc > 2) {
+    bench_replay(argv[2], argc > 3 ? atoi(argv[3]) : 9600);
+  }
+#endif
+  return 0;
+}
\ No newline at end of file
@@ -1,3 +1,5 @@
+#include <time.h>
+
 #include "modbus/modbus.h"
 
 void *modbus_arch_malloc(int size) { return malloc(size); }
@@ -5,6 +7,11 @@ void modbus_arch_free(void *ptr) { free(ptr); }
 void modbus_arch_memset(void *s, int c, int l) { memset(s, c, l); }
 void modbus_arch_memcpy(void *d, void *s, int l) { memcpy(d, s, l); }
 uint16_t modbus_arch_htons(uint16_t v) { return htons(v); }
+uint32_t modbus_arch_millis(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
 static void modbus_driver_slave_init() {}
 static void modbus_driver_slave_kill() {}
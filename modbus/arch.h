@@ -11,4 +11,12 @@ void modbus_arch_memset(void* s, int c, int l);
 void modbus_arch_memcpy(void* d, void* s, int l);
 uint16_t modbus_arch_htons(uint16_t v);
 
+// monotonic milliseconds, free to wrap around
+uint32_t modbus_arch_millis(void);
+
+#if defined(MODBUS_STATS) || defined(MODBUS_CAPTURE)
+// monotonic microseconds for latency histograms and capture timestamps
+uint32_t modbus_arch_micros(void);
+#endif
+
 #endif
\ No newline at end of file
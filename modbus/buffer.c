@@ -1,11 +1,26 @@
 #include "buffer.h"
 
 #include "arch.h"
+#include "swap.h"
+
+static int buffer_mask(int capacity) {
+  if (capacity > 0 && (capacity & (capacity - 1)) == 0) {
+    return capacity - 1;
+  }
+  return 0;
+}
+
+static int buffer_wrap(modbus_buffer_t* b, int pos) {
+  if (b->mask) return pos & b->mask;
+  if (pos >= b->capacity) pos -= b->capacity;
+  return pos;
+}
 
 void modbus_buffer_init(modbus_buffer_t* b, int capacity) {
   modbus_arch_memset(b, 0, sizeof(modbus_buffer_t));
 
   b->capacity = capacity;
+  b->mask = buffer_mask(capacity);
   b->raws = modbus_arch_malloc(capacity);
   b->flag |= MODBUS_BUFFER_EMPTY;
   b->flag |= MODBUS_BUFFER_ALLOC;
@@ -22,6 +37,7 @@ void modbus_buffer_init_reader(modbus_buffer_t* b, uint8_t* src, int len) {
   modbus_arch_memset(b, 0, sizeof(modbus_buffer_t));
 
   b->capacity = len;
+  b->mask = buffer_mask(len);
   b->raws = src;
   b->flag |= MODBUS_BUFFER_FULL;
 }
@@ -30,6 +46,7 @@ void modbus_buffer_init_writer(modbus_buffer_t* b, uint8_t* src, int capacity) {
   modbus_arch_memset(b, 0, sizeof(modbus_buffer_t));
 
   b->capacity = capacity;
+  b->mask = buffer_mask(capacity);
   b->raws = src;
   b->flag = MODBUS_BUFFER_EMPTY;
 }
@@ -40,12 +57,32 @@ void modbus_buffer_skip(modbus_buffer_t* b, int len) {
     len = length;
   }
 
-  b->readpos += len;
-  b->readpos %= b->capacity;
-  if (b->readpos == b->writpos) {
-    b->flag |= MODBUS_BUFFER_EMPTY;
+  modbus_buffer_commit_read(b, len);
+}
+
+void modbus_buffer_limit(modbus_buffer_t* b, int len) {
+  if (len >= modbus_buffer_length(b)) {
+    return;
   }
+
+  b->writpos = buffer_wrap(b, b->readpos + len);
   b->flag &= ~MODBUS_BUFFER_FULL;
+  if (len == 0) {
+    b->flag |= MODBUS_BUFFER_EMPTY;
+  }
+}
+
+uint8_t* modbus_buffer_peek(modbus_buffer_t* b, int len) {
+  modbus_span_t spans[2];
+  if (len <= 0 || modbus_buffer_peek_contiguous(b, spans) == 0) {
+    return 0;
+  }
+
+  if (spans[0].length < len) {
+    return 0;
+  }
+
+  return spans[0].raws;
 }
 
 void modbus_buffer_copy(modbus_buffer_t* d, modbus_buffer_t* s) {
@@ -61,13 +98,12 @@ bool modbus_buffer_is_empty(modbus_buffer_t* b) {
 }
 
 int modbus_buffer_length(modbus_buffer_t* b) {
-  if (modbus_buffer_is_empty(b)) return 0;
-  if (modbus_buffer_is_full(b)) return b->capacity;
+  if (b->flag & MODBUS_BUFFER_EMPTY) return 0;
+  if (b->flag & MODBUS_BUFFER_FULL) return b->capacity;
 
-  int len = 0;
-  len += b->writpos - b->readpos;
-  len += b->capacity;
-  len %= b->capacity;
+  int len = b->writpos - b->readpos;
+  if (b->mask) return len & b->mask;
+  if (len < 0) len += b->capacity;
   return len;
 }
 
@@ -75,95 +111,120 @@ int modbus_buffer_free(modbus_buffer_t* b) {
   return b->capacity - modbus_buffer_length(b);
 }
 
-int modbus_buffer_write(modbus_buffer_t* b, uint8_t* raw, int len) {
-  int writed = 0;
-  if (modbus_buffer_free(b) < len) {
-    return writed;
+int modbus_buffer_peek_contiguous(modbus_buffer_t* b, modbus_span_t* spans) {
+  int length = modbus_buffer_length(b);
+  if (length == 0) return 0;
+
+  int tail = b->capacity - b->readpos;
+  spans[0].raws = &b->raws[b->readpos];
+  if (length <= tail) {
+    spans[0].length = length;
+    return 1;
   }
 
-  uint8_t* write_pos;
-  int write_len;
+  spans[0].length = tail;
+  spans[1].raws = b->raws;
+  spans[1].length = length - tail;
+  return 2;
+}
 
-  write_pos = &b->raws[b->writpos];
-  if (b->readpos > b->writpos) {
-    write_len = (b->readpos - b->writpos);
-  } else {
-    write_len = (b->capacity - b->writpos);
+int modbus_buffer_reserve_contiguous(modbus_buffer_t* b,
+                                     modbus_span_t* spans) {
+  int space = modbus_buffer_free(b);
+  if (space == 0) return 0;
+
+  int tail = b->capacity - b->writpos;
+  spans[0].raws = &b->raws[b->writpos];
+  if (space <= tail) {
+    spans[0].length = space;
+    return 1;
   }
 
-  if (write_len > len) {
-    write_len = len;
+  spans[0].length = tail;
+  spans[1].raws = b->raws;
+  spans[1].length = space - tail;
+  return 2;
+}
+
+void modbus_buffer_commit_read(modbus_buffer_t* b, int len) {
+  if (len <= 0) return;
+
+  b->readpos = buffer_wrap(b, b->readpos + len);
+  if (b->readpos == b->writpos) {
+    b->flag |= MODBUS_BUFFER_EMPTY;
   }
+  b->flag &= ~MODBUS_BUFFER_FULL;
+}
 
-  modbus_arch_memcpy(write_pos, raw, write_len);
-  b->writpos += write_len;
-  b->writpos %= b->capacity;
+void modbus_buffer_commit_write(modbus_buffer_t* b, int len) {
+  if (len <= 0) return;
+
+  b->writpos = buffer_wrap(b, b->writpos + len);
   if (b->writpos == b->readpos) {
     b->flag |= MODBUS_BUFFER_FULL;
   }
   b->flag &= ~MODBUS_BUFFER_EMPTY;
+}
 
-  len -= write_len;
-  raw += write_len;
-  writed += write_len;
+int modbus_buffer_write(modbus_buffer_t* b, uint8_t* raw, int len) {
+  modbus_span_t spans[2];
+  if (len <= 0 || modbus_buffer_free(b) < len) {
+    return 0;
+  }
 
-  if (len > 0) {
-    writed += modbus_buffer_write(b, raw, len);
+  int count = modbus_buffer_reserve_contiguous(b, spans);
+  int writed = 0;
+  for (int i = 0; i < count && writed < len; i++) {
+    int write_len = len - writed;
+    if (write_len > spans[i].length) {
+      write_len = spans[i].length;
+    }
+
+    modbus_arch_memcpy(spans[i].raws, raw + writed, write_len);
+    writed += write_len;
   }
 
+  modbus_buffer_commit_write(b, writed);
   return writed;
 }
 
 int modbus_buffer_read(modbus_buffer_t* b, uint8_t* raw, int len) {
+  modbus_span_t spans[2];
+  int count = modbus_buffer_peek_contiguous(b, spans);
   int readed = 0;
 
-  if (modbus_buffer_is_empty(b)) {
-    return readed;
-  }
-
-  uint8_t* read_pos;
-  int read_len;
+  for (int i = 0; i < count && readed < len; i++) {
+    int read_len = len - readed;
+    if (read_len > spans[i].length) {
+      read_len = spans[i].length;
+    }
 
-  read_pos = &b->raws[b->readpos];
-  if (b->writpos > b->readpos) {
-    read_len = b->writpos - b->readpos;
-  } else {
-    read_len = b->capacity - b->readpos;
-  }
-
-  if (read_len > len) {
-    read_len = len;
-  }
-
-  modbus_arch_memcpy(raw, read_pos, read_len);
-  b->readpos += read_len;
-  b->readpos %= b->capacity;
-  if (b->readpos == b->writpos) {
-    b->flag |= MODBUS_BUFFER_EMPTY;
-  }
-  b->flag &= ~MODBUS_BUFFER_FULL;
-
-  len -= read_len;
-  raw += read_len;
-  readed += read_len;
-
-  if (len > 0) {
-    readed += modbus_buffer_read(b, raw, len);
+    modbus_arch_memcpy(raw + readed, spans[i].raws, read_len);
+    readed += read_len;
   }
 
+  modbus_buffer_commit_read(b, readed);
   return readed;
 }
 
 bool modbus_buffer_read_u8(modbus_buffer_t* b, uint8_t* v) {
-  int readed = modbus_buffer_read(b, v, 1);
+  if (modbus_buffer_is_empty(b)) {
+    return false;
+  }
 
-  return readed == 1;
+  *v = b->raws[b->readpos];
+  modbus_buffer_commit_read(b, 1);
+  return true;
 }
 
 bool modbus_buffer_write_u8(modbus_buffer_t* b, uint8_t* v) {
-  int writed = modbus_buffer_write(b, v, 1);
+  if (modbus_buffer_is_full(b)) {
+    return false;
+  }
 
-  return writed == 1;
+  b->raws[b->writpos] = *v;
+  modbus_buffer_commit_write(b, 1);
+  return true;
 }
 
 bool modbus_buffer_read_u16(modbus_buffer_t* b, uint16_t* v, bool msb) {
@@ -187,73 +248,110 @@ bool modbus_buffer_write_u16(modbus_buffer_t* b, uint16_t* v, bool msb) {
   return writed == 2;
 }
 
-int modbus_buffer_writer(modbus_buffer_t* b, buffer_stream_t reader,
-                         void* arg) {
-  uint8_t* write_pos;
-  int write_len;
-  int writed = 0;
-
-  if (modbus_buffer_is_full(b)) {
-    return writed;
+bool modbus_buffer_read_u16s(modbus_buffer_t* b, uint16_t* v, int count,
+                             bool msb) {
+  modbus_span_t spans[2];
+  int len = count * 2;
+  if (len == 0) {
+    return true;
   }
 
-  write_pos = &b->raws[b->writpos];
-  if (b->readpos > b->writpos) {
-    write_len = (b->readpos - b->writpos);
-  } else {
-    write_len = (b->capacity - b->writpos);
+  if (modbus_buffer_length(b) < len) {
+    return false;
   }
 
-  int read_len = reader(arg, write_pos, write_len);
-  if (read_len == 0) return writed;
+  if (!msb) {
+    return modbus_buffer_read(b, (uint8_t*)v, len) == len;
+  }
 
-  b->writpos += read_len;
-  b->writpos %= b->capacity;
-  if (b->writpos == b->readpos) {
-    b->flag |= MODBUS_BUFFER_FULL;
+  if (modbus_buffer_peek_contiguous(b, spans) == 0) {
+    return false;
   }
-  b->flag &= ~MODBUS_BUFFER_EMPTY;
 
-  writed += read_len;
-  if (read_len == write_len) {
-    writed += modbus_buffer_writer(b, reader, arg);
+  if (spans[0].length >= len) {
+    modbus_swap16_load(v, spans[0].raws, count);
+  } else {
+    int head = spans[0].length;
+    uint8_t* dst = (uint8_t*)v;
+    modbus_arch_memcpy(dst, spans[0].raws, head);
+    modbus_arch_memcpy(dst + head, spans[1].raws, len - head);
+    modbus_swap16_load(v, dst, count);
   }
 
-  return writed;
+  modbus_buffer_commit_read(b, len);
+  return true;
 }
 
-int modbus_buffer_reader(modbus_buffer_t* b, buffer_stream_t writer,
-                         void* arg) {
-  int readed = 0;
+bool modbus_buffer_write_u16s(modbus_buffer_t* b, uint16_t* v, int count,
+                              bool msb) {
+  modbus_span_t spans[2];
+  int len = count * 2;
+  if (len == 0) {
+    return true;
+  }
 
-  if (modbus_buffer_is_empty(b)) {
-    return readed;
+  if (modbus_buffer_free(b) < len) {
+    return false;
+  }
+
+  if (!msb) {
+    return modbus_buffer_write(b, (uint8_t*)v, len) == len;
   }
 
-  uint8_t* read_pos;
-  int read_len;
+  if (modbus_buffer_reserve_contiguous(b, spans) == 0) {
+    return false;
+  }
 
-  read_pos = &b->raws[b->readpos];
-  if (b->writpos > b->readpos) {
-    read_len = b->writpos - b->readpos;
+  if (spans[0].length >= len) {
+    modbus_swap16_store(spans[0].raws, v, count);
   } else {
-    read_len = b->capacity - b->readpos;
+    // the wrap may split a register, its two bytes go one to each span
+    int head = spans[0].length / 2;
+    uint8_t* tail = spans[1].raws;
+    modbus_swap16_store(spans[0].raws, v, head);
+    if (spans[0].length & 1) {
+      spans[0].raws[head * 2] = v[head] >> 8;
+      *tail++ = v[head] & 0xFF;
+      head++;
+    }
+    modbus_swap16_store(tail, v + head, count - head);
   }
 
-  int write_len = writer(arg, read_pos, read_len);
-  if (write_len == 0) return readed;
+  modbus_buffer_commit_write(b, len);
+  return true;
+}
 
-  b->readpos += write_len;
-  b->readpos %= b->capacity;
-  if (b->readpos == b->writpos) {
-    b->flag |= MODBUS_BUFFER_EMPTY;
+int modbus_buffer_writer(modbus_buffer_t* b, buffer_stream_t reader,
+                         void* arg) {
+  modbus_span_t spans[2];
+  int count = modbus_buffer_reserve_contiguous(b, spans);
+  int writed = 0;
+
+  for (int i = 0; i < count; i++) {
+    int read_len = reader(arg, spans[i].raws, spans[i].length);
+    if (read_len <= 0) break;
+
+    modbus_buffer_commit_write(b, read_len);
+    writed += read_len;
+    if (read_len != spans[i].length) break;
   }
-  b->flag &= ~MODBUS_BUFFER_FULL;
 
-  readed += write_len;
+  return writed;
+}
+
+int modbus_buffer_reader(modbus_buffer_t* b, buffer_stream_t writer,
+                         void* arg) {
+  modbus_span_t spans[2];
+  int count = modbus_buffer_peek_contiguous(b, spans);
+  int readed = 0;
+
+  for (int i = 0; i < count; i++) {
+    int write_len = writer(arg, spans[i].raws, spans[i].length);
+    if (write_len <= 0) break;
 
-  if (read_len == write_len) {
-    readed += modbus_buffer_reader(b, writer, arg);
+    modbus_buffer_commit_read(b, write_len);
+    readed += write_len;
+    if (write_len != spans[i].length) break;
   }
 
   return readed;
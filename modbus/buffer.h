@@ -10,12 +10,18 @@
 
 typedef struct {
   int capacity;
+  int mask;
   int readpos;
   int writpos;
   uint8_t flag;
   uint8_t* raws;
 } modbus_buffer_t;
 
+typedef struct {
+  uint8_t* raws;
+  int length;
+} modbus_span_t;
+
 void modbus_buffer_init(modbus_buffer_t* b, int capacity);
 void modbus_buffer_kill(modbus_buffer_t* b);
 
@@ -23,6 +29,8 @@ void modbus_buffer_init_reader(modbus_buffer_t* b, uint8_t* src, int len);
 void modbus_buffer_init_writer(modbus_buffer_t* b, uint8_t* src, int capacity);
 
 void modbus_buffer_skip(modbus_buffer_t* b, int len);
+void modbus_buffer_limit(modbus_buffer_t* b, int len);
+uint8_t* modbus_buffer_peek(modbus_buffer_t* b, int len);
 void modbus_buffer_copy(modbus_buffer_t* d, modbus_buffer_t* s);
 
 int modbus_buffer_length(modbus_buffer_t* b);
@@ -30,6 +38,12 @@ int modbus_buffer_free(modbus_buffer_t* b);
 bool modbus_buffer_is_empty(modbus_buffer_t* b);
 bool modbus_buffer_is_full(modbus_buffer_t* b);
 
+// readable and writable regions as at most two spans, returns span count
+int modbus_buffer_peek_contiguous(modbus_buffer_t* b, modbus_span_t* spans);
+int modbus_buffer_reserve_contiguous(modbus_buffer_t* b, modbus_span_t* spans);
+void modbus_buffer_commit_read(modbus_buffer_t* b, int len);
+void modbus_buffer_commit_write(modbus_buffer_t* b, int len);
+
 int modbus_buffer_write(modbus_buffer_t* b, uint8_t* raw, int len);
 int modbus_buffer_read(modbus_buffer_t* b, uint8_t* raw, int len);
 
@@ -39,6 +53,11 @@ bool modbus_buffer_write_u8(modbus_buffer_t* b, uint8_t* v);
 bool modbus_buffer_read_u16(modbus_buffer_t* b, uint16_t* v, bool msb);
 bool modbus_buffer_write_u16(modbus_buffer_t* b, uint16_t* v, bool msb);
 
+bool modbus_buffer_read_u16s(modbus_buffer_t* b, uint16_t* v, int count,
+                             bool msb);
+bool modbus_buffer_write_u16s(modbus_buffer_t* b, uint16_t* v, int count,
+                              bool msb);
+
 typedef int (*buffer_stream_t)(void* arg, uint8_t* buf, int max);
 int modbus_buffer_writer(modbus_buffer_t* b, buffer_stream_t reader, void* arg);
 int modbus_buffer_reader(modbus_buffer_t* b, buffer_stream_t writer, void* arg);
@@ -0,0 +1,395 @@
+#include "capture.h"
+
+#if defined(MODBUS_CAPTURE)
+
+// the producer publishes head after the record bytes and the consumer tail
+// after reading them, ordered where the compiler offers it
+#if defined(__GNUC__)
+#define CAPTURE_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define CAPTURE_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#define CAPTURE_LOAD(p) (*(volatile uint32_t*)(p))
+#define CAPTURE_STORE(p, v) (*(volatile uint32_t*)(p) = (v))
+#endif
+
+#define CAPTURE_PCAP_LINKTYPE (101)
+#define CAPTURE_PCAP_HEADER_SIZE (16)
+#define CAPTURE_IP_HEADER_SIZE (28)
+
+static void capture_le16(uint8_t* raw, uint16_t v) {
+  raw[0] = v;
+  raw[1] = v >> 8;
+}
+
+static void capture_le32(uint8_t* raw, uint32_t v) {
+  capture_le16(raw, v);
+  capture_le16(raw + 2, v >> 16);
+}
+
+static void capture_be16(uint8_t* raw, uint16_t v) {
+  raw[0] = v >> 8;
+  raw[1] = v;
+}
+
+static uint16_t capture_read16(uint8_t* raw) { return raw[0] | raw[1] << 8; }
+
+static uint32_t capture_read32(uint8_t* raw) {
+  return capture_read16(raw) | (uint32_t)capture_read16(raw + 2) << 16;
+}
+
+static void capture_put(modbus_capture_t* c, uint32_t pos, uint8_t* src,
+                        int len) {
+  uint32_t at = pos & (c->size - 1);
+  int first = c->size - at;
+  if (first > len) first = len;
+
+  modbus_arch_memcpy(&c->ring[at], src, first);
+  if (len > first) {
+    modbus_arch_memcpy(c->ring, src + first, len - first);
+  }
+}
+
+static void capture_get(modbus_capture_t* c, uint32_t pos, uint8_t* dst,
+                        int len) {
+  uint32_t at = pos & (c->size - 1);
+  int first = c->size - at;
+  if (first > len) first = len;
+
+  modbus_arch_memcpy(dst, &c->ring[at], first);
+  if (len > first) {
+    modbus_arch_memcpy(dst + first, c->ring, len - first);
+  }
+}
+
+// writes len ring bytes starting at pos, at most two calls around the end
+static bool capture_write(modbus_capture_t* c, uint32_t pos, int len,
+                          buffer_stream_t writer, void* arg) {
+  while (len > 0) {
+    uint32_t at = pos & (c->size - 1);
+    int span = c->size - at;
+    if (span > len) span = len;
+
+    if (writer(arg, &c->ring[at], span) != span) return false;
+    pos += span;
+    len -= span;
+  }
+
+  return true;
+}
+
+bool modbus_capture_init(modbus_capture_t* c, uint8_t* ring, uint32_t size,
+                         uint8_t format) {
+  if (size == 0 || (size & (size - 1)) != 0) {
+    return false;
+  }
+
+  modbus_arch_memset(c, 0, sizeof(modbus_capture_t));
+  c->ring = ring;
+  c->size = size;
+  c->format = format;
+  return true;
+}
+
+void modbus_capture_frame(modbus_capture_t* c, uint8_t flag, uint16_t channel,
+                          modbus_buffer_t* frame) {
+  int len = modbus_buffer_length(frame);
+  uint32_t head = c->head;
+  uint32_t tail = CAPTURE_LOAD(&c->tail);
+
+  if (c->size - (head - tail) < (uint32_t)MODBUS_CAPTURE_RECORD_SIZE + len) {
+    c->lost++;
+    return;
+  }
+
+  uint8_t record[MODBUS_CAPTURE_RECORD_SIZE];
+  capture_le32(record, modbus_arch_micros());
+  capture_le16(record + 4, channel);
+  record[6] = flag;
+  capture_le16(record + 7, len);
+  capture_put(c, head, record, MODBUS_CAPTURE_RECORD_SIZE);
+  head += MODBUS_CAPTURE_RECORD_SIZE;
+
+  modbus_span_t spans[2];
+  int count = modbus_buffer_peek_contiguous(frame, spans);
+  for (int i = 0; i < count; i++) {
+    capture_put(c, head, spans[i].raws, spans[i].length);
+    head += spans[i].length;
+  }
+
+  CAPTURE_STORE(&c->head, head);
+}
+
+static bool capture_header(modbus_capture_t* c, buffer_stream_t writer,
+                           void* arg) {
+  uint8_t header[24];
+  int len = MODBUS_CAPTURE_HEADER_SIZE;
+
+  if (c->format == MODBUS_CAPTURE_FORMAT_PCAP) {
+    // microsecond pcap 2.4, snaplen 65535, raw ip frames
+    capture_le32(header, 0xa1b2c3d4);
+    capture_le16(header + 4, 2);
+    capture_le16(header + 6, 4);
+    capture_le32(header + 8, 0);
+    capture_le32(header + 12, 0);
+    capture_le32(header + 16, 65535);
+    capture_le32(header + 20, CAPTURE_PCAP_LINKTYPE);
+    len = 24;
+  } else {
+    modbus_arch_memcpy(header, "MBCP", 4);
+    capture_le16(header + 4, MODBUS_CAPTURE_VERSION);
+    capture_le16(header + 6, 0);
+  }
+
+  return writer(arg, header, len) == len;
+}
+
+// pcap record and ipv4/udp headers for one frame, the node is 10.0.0.1
+// and each channel a peer at 10.1.x.y
+static void capture_pcap(modbus_capture_t* c, uint8_t flag, uint16_t channel,
+                         int len, uint8_t* raw) {
+  uint64_t ts = c->clock + (uint64_t)c->epoch * 1000000;
+  int ip_len = CAPTURE_IP_HEADER_SIZE + len;
+
+  capture_le32(raw, ts / 1000000);
+  capture_le32(raw + 4, ts % 1000000);
+  capture_le32(raw + 8, ip_len);
+  capture_le32(raw + 12, ip_len);
+
+  uint8_t* ip = raw + CAPTURE_PCAP_HEADER_SIZE;
+  uint8_t node[4] = {10, 0, 0, 1};
+  uint8_t peer[4] = {10, 1, channel >> 8, channel};
+  bool tx = (flag & MODBUS_CAPTURE_TX) == MODBUS_CAPTURE_TX;
+
+  modbus_arch_memset(ip, 0, CAPTURE_IP_HEADER_SIZE);
+  ip[0] = 0x45;
+  capture_be16(ip + 2, ip_len);
+  ip[6] = 0x40;
+  ip[8] = 64;
+  ip[9] = 17;
+  modbus_arch_memcpy(ip + 12, tx ? node : peer, 4);
+  modbus_arch_memcpy(ip + 16, tx ? peer : node, 4);
+
+  uint32_t sum = 0;
+  for (int i = 0; i < 20; i += 2) {
+    sum += ip[i] << 8 | ip[i + 1];
+  }
+  while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+  capture_be16(ip + 10, ~sum);
+
+  uint16_t port = 502;
+  if ((flag & MODBUS_CAPTURE_SOCKET) != MODBUS_CAPTURE_SOCKET) {
+    port = MODBUS_CAPTURE_RTU_PORT;
+  }
+
+  // the udp checksum is optional over ipv4 and left out
+  uint8_t* udp = ip + 20;
+  capture_be16(udp, tx ? port : 49152 + channel % 16384);
+  capture_be16(udp + 2, tx ? 49152 + channel % 16384 : port);
+  capture_be16(udp + 4, 8 + len);
+}
+
+int modbus_capture_flush(modbus_capture_t* c, buffer_stream_t writer,
+                         void* arg) {
+  if (!c->started) {
+    if (!capture_header(c, writer, arg)) return 0;
+    c->started = true;
+  }
+
+  uint32_t head = CAPTURE_LOAD(&c->head);
+  uint32_t tail = c->tail;
+  uint32_t start = tail;
+
+  if (c->format != MODBUS_CAPTURE_FORMAT_PCAP) {
+    if (capture_write(c, tail, head - tail, writer, arg)) {
+      CAPTURE_STORE(&c->tail, head);
+      return head - start;
+    }
+    return 0;
+  }
+
+  while (tail != head) {
+    uint8_t record[MODBUS_CAPTURE_RECORD_SIZE];
+    capture_get(c, tail, record, MODBUS_CAPTURE_RECORD_SIZE);
+
+    uint32_t micros = capture_read32(record);
+    uint16_t channel = capture_read16(record + 4);
+    uint16_t len = capture_read16(record + 7);
+
+    // capture time is kept relative to the first record
+    if (c->records++) {
+      c->clock += (uint32_t)(micros - c->last);
+    }
+    c->last = micros;
+
+    uint8_t raw[CAPTURE_PCAP_HEADER_SIZE + CAPTURE_IP_HEADER_SIZE];
+    capture_pcap(c, record[6], channel, len, raw);
+    if (writer(arg, raw, sizeof(raw)) != sizeof(raw)) break;
+
+    tail += MODBUS_CAPTURE_RECORD_SIZE;
+    if (!capture_write(c, tail, len, writer, arg)) break;
+
+    tail += len;
+    CAPTURE_STORE(&c->tail, tail);
+  }
+
+  return tail - start;
+}
+
+static void replay_load(modbus_replay_t* r) {
+  if (r->pos + MODBUS_CAPTURE_RECORD_SIZE > r->length) {
+    r->pos = r->length;
+    return;
+  }
+
+  uint8_t* record = &r->data[r->pos];
+  if (r->pos + MODBUS_CAPTURE_RECORD_SIZE + capture_read16(record + 7) >
+      r->length) {
+    r->pos = r->length;
+    return;
+  }
+
+  uint32_t micros = capture_read32(record);
+  r->clock += (uint32_t)(micros - r->last);
+  r->last = micros;
+}
+
+static void replay_next(modbus_replay_t* r) {
+  r->pos += MODBUS_CAPTURE_RECORD_SIZE + capture_read16(&r->data[r->pos + 7]);
+  r->offset = 0;
+  replay_load(r);
+}
+
+static int replay_recv(void* this, uint8_t* buf, int max) {
+  modbus_replay_t* r = this;
+
+  int len = 0;
+  while (len < max && r->pos < r->length) {
+    uint8_t* record = &r->data[r->pos];
+    uint8_t flag = record[6] & ~MODBUS_CAPTURE_REJECT;
+    if (flag != (r->kind | MODBUS_CAPTURE_RX)) {
+      replay_next(r);
+      continue;
+    }
+
+    if (r->realtime && r->offset == 0) {
+      uint32_t now = modbus_arch_micros();
+      r->elapsed += (uint32_t)(now - r->tick);
+      r->tick = now;
+      if (r->clock > r->elapsed) break;
+    }
+
+    int size = capture_read16(record + 7);
+    int n = size - r->offset;
+    if (n > max - len) n = max - len;
+
+    modbus_arch_memcpy(buf + len, record + MODBUS_CAPTURE_RECORD_SIZE +
+                                      r->offset, n);
+    r->offset += n;
+    len += n;
+
+    if (r->offset == size) {
+      if (record[6] == flag) r->frames++;
+      if (r->realtime) r->idle = modbus_arch_micros();
+      replay_next(r);
+    }
+  }
+
+  r->received += len;
+  return len;
+}
+
+static int replay_send(void* this, uint8_t* buf, int len) {
+  modbus_replay_t* r = this;
+  r->sent += len;
+  return len;
+}
+
+// a frame handed out in part is still arriving, as fast as possible every
+// whole frame is followed by enough silence to close it
+static uint32_t replay_silence(void* this) {
+  modbus_replay_t* r = this;
+  if (r->offset > 0) return 0;
+  if (!r->realtime) return UINT32_MAX;
+
+  return modbus_arch_micros() - r->idle;
+}
+
+static void replay_rtu_init(void* this) {
+  modbus_replay_t* r = this;
+  modbus_buffer_init(&r->rtu.inbuf, MODBUS_REPLAY_BUFFER_SIZE);
+  modbus_buffer_init(&r->rtu.oubuf, MODBUS_REPLAY_BUFFER_SIZE);
+}
+
+static void replay_rtu_kill(void* this) {
+  modbus_replay_t* r = this;
+  modbus_buffer_kill(&r->rtu.inbuf);
+  modbus_buffer_kill(&r->rtu.oubuf);
+}
+
+static void replay_socket_init(void* this) {
+  modbus_replay_t* r = this;
+  modbus_buffer_init(&r->socket.inbuf, MODBUS_REPLAY_BUFFER_SIZE);
+}
+
+static void replay_socket_kill(void* this) {
+  modbus_replay_t* r = this;
+  modbus_buffer_kill(&r->socket.inbuf);
+}
+
+bool modbus_replay_init(modbus_replay_t* r, uint8_t kind, uint8_t* data,
+                        int length, uint32_t baud, bool realtime) {
+  modbus_arch_memset(r, 0, sizeof(modbus_replay_t));
+
+  if (kind == MODBUS_CAPTURE_RTU && baud == 0) {
+    return false;
+  }
+
+  if (length < MODBUS_CAPTURE_HEADER_SIZE ||
+      data[0] != 'M' || data[1] != 'B' || data[2] != 'C' || data[3] != 'P' ||
+      capture_read16(data + 4) != MODBUS_CAPTURE_VERSION) {
+    return false;
+  }
+
+  if (kind == MODBUS_CAPTURE_SOCKET) {
+    r->socket.init = replay_socket_init;
+    r->socket.kill = replay_socket_kill;
+    r->socket.recv = replay_recv;
+    r->socket.send = replay_send;
+    r->socket.cache = r->cache;
+    r->socket.cache_len = MODBUS_REPLAY_CACHE_SIZE;
+  } else {
+    r->rtu.init = replay_rtu_init;
+    r->rtu.kill = replay_rtu_kill;
+    r->rtu.recv = replay_recv;
+    r->rtu.send = replay_send;
+    r->rtu.silence = replay_silence;
+    r->rtu.baud = baud;
+  }
+
+  r->kind = kind;
+  r->realtime = realtime;
+  r->data = data;
+  r->length = length;
+
+  modbus_replay_rewind(r);
+  return true;
+}
+
+void modbus_replay_rewind(modbus_replay_t* r) {
+  r->pos = MODBUS_CAPTURE_HEADER_SIZE;
+  r->offset = 0;
+  r->clock = 0;
+  r->last = 0;
+  if (r->pos + 4 <= r->length) {
+    r->last = capture_read32(&r->data[r->pos]);
+  }
+  replay_load(r);
+
+  r->tick = modbus_arch_micros();
+  r->idle = r->tick;
+  r->elapsed = 0;
+}
+
+bool modbus_replay_done(modbus_replay_t* r) { return r->pos >= r->length; }
+
+#endif
\ No newline at end of file
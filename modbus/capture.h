@@ -0,0 +1,124 @@
+#ifndef __MODBUS_CAPTURE_H__
+#define __MODBUS_CAPTURE_H__
+
+#include "arch.h"
+#include "buffer.h"
+#include "define.h"
+
+// raw frame capture at the parser boundary and a driver replaying it, built
+// only with MODBUS_CAPTURE defined
+//
+// the file is a header of "MBCP", u16 version and u16 zero, then records of
+// u32 microseconds, u16 channel, u8 flag, u16 length and the frame bytes,
+// all little endian; the ring holds the same records
+
+#define MODBUS_CAPTURE_RX (0x00)
+#define MODBUS_CAPTURE_TX (0x01)
+#define MODBUS_CAPTURE_RTU (0x00)
+#define MODBUS_CAPTURE_SOCKET (0x02)
+// received bytes the parser dropped, noise or a frame that failed its check
+#define MODBUS_CAPTURE_REJECT (0x04)
+
+#define MODBUS_CAPTURE_FORMAT_RAW (0)
+#define MODBUS_CAPTURE_FORMAT_PCAP (1)
+
+#define MODBUS_CAPTURE_HEADER_SIZE (8)
+#define MODBUS_CAPTURE_RECORD_SIZE (9)
+#define MODBUS_CAPTURE_VERSION (1)
+
+// pcap frames are ipv4/udp, socket frames use 502 where wireshark decodes
+// mbap, rtu frames this port to be decoded as modbus rtu over udp
+#ifndef MODBUS_CAPTURE_RTU_PORT
+#define MODBUS_CAPTURE_RTU_PORT (5020)
+#endif
+
+#ifndef MODBUS_REPLAY_BUFFER_SIZE
+#define MODBUS_REPLAY_BUFFER_SIZE (512)
+#endif
+
+#ifndef MODBUS_REPLAY_CACHE_SIZE
+#define MODBUS_REPLAY_CACHE_SIZE (260)
+#endif
+
+#if defined(MODBUS_CAPTURE)
+
+struct modbus_capture {
+  // single producer ring, the parser side only moves head and the flush
+  // side only moves tail so neither needs a lock
+  uint8_t* ring;
+  uint32_t size;
+  uint32_t head;
+  uint32_t tail;
+  // frames that found the ring full, written by the producer
+  uint32_t lost;
+
+  // flush side, capture time is unwrapped to 64 bits for pcap
+  uint8_t format;
+  bool started;
+  uint64_t records;
+  uint32_t last;
+  uint64_t clock;
+  // seconds added to pcap timestamps, 0 starts them at the epoch
+  uint32_t epoch;
+};
+
+typedef struct modbus_replay {
+  // first member, the replay is handed to modbus_t as its driver
+  union {
+    modbus_driver_rtu_t rtu;
+    modbus_driver_socket_t socket;
+  };
+
+  // received frames of this kind are fed, everything else is skipped
+  uint8_t kind;
+  bool realtime;
+
+  // whole capture file in memory, pos is the record being fed and offset
+  // its bytes already handed to the driver
+  uint8_t* data;
+  int length;
+  int pos;
+  int offset;
+
+  // capture time of the current record and replay time, unwrapped
+  uint32_t last;
+  uint64_t clock;
+  uint64_t first;
+  uint32_t tick;
+  uint64_t elapsed;
+  // when the last whole frame was handed out
+  uint32_t idle;
+
+  // whole received frames handed out, rejected bytes not counted
+  uint64_t frames;
+  uint64_t received;
+  uint64_t sent;
+  uint8_t cache[MODBUS_REPLAY_CACHE_SIZE];
+} modbus_replay_t;
+
+// size must be a power of two
+bool modbus_capture_init(modbus_capture_t* c, uint8_t* ring, uint32_t size,
+                         uint8_t format);
+
+// records the readable bytes of frame, flag is a direction and a kind
+void modbus_capture_frame(modbus_capture_t* c, uint8_t flag, uint16_t channel,
+                          modbus_buffer_t* frame);
+
+// drains the ring into writer, which takes every byte like fwrite, and
+// returns the ring bytes consumed; call it from a background thread or idle
+int modbus_capture_flush(modbus_capture_t* c, buffer_stream_t writer,
+                         void* arg);
+
+// data is a raw capture file, realtime keeps the recorded gaps between
+// frames and otherwise frames are fed as fast as the parser takes them;
+// rejected bytes are fed too; an rtu replay needs the baud of the recorded
+// line to frame by t3.5, a socket replay ignores it; call it before
+// modbus_init, which sets up the driver buffers
+bool modbus_replay_init(modbus_replay_t* r, uint8_t kind, uint8_t* data,
+                        int length, uint32_t baud, bool realtime);
+void modbus_replay_rewind(modbus_replay_t* r);
+bool modbus_replay_done(modbus_replay_t* r);
+
+#endif
+
+#endif
\ No newline at end of file
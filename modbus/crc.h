@@ -0,0 +1,31 @@
+#ifndef __MODBUS_CRC_H__
+#define __MODBUS_CRC_H__
+
+#include "buffer.h"
+#include "inttypes.h"
+
+#define MODBUS_CRC16_INIT (0xFFFF)
+
+#if defined(__PCLMUL__) && defined(__x86_64__)
+#define MODBUS_CRC16_HAS_CLMUL 1
+#else
+#define MODBUS_CRC16_HAS_CLMUL 0
+#endif
+
+// every engine continues a running crc, start with MODBUS_CRC16_INIT
+uint16_t modbus_crc16_bitwise(uint16_t crc, uint8_t* buf, int len);
+uint16_t modbus_crc16_table(uint16_t crc, uint8_t* buf, int len);
+uint16_t modbus_crc16_slice8(uint16_t crc, uint8_t* buf, int len);
+#if MODBUS_CRC16_HAS_CLMUL
+uint16_t modbus_crc16_clmul(uint16_t crc, uint8_t* buf, int len);
+#endif
+
+// slice8, or clmul when built with MODBUS_CRC16_USE_CLMUL; on frames of
+// modbus size clmul measures slower than slice8, so it is never the default
+uint16_t modbus_crc16(uint16_t crc, uint8_t* buf, int len);
+
+// crc of the first len readable bytes, the buffer is not consumed
+uint16_t modbus_crc16_buffer(modbus_buffer_t* b, int len);
+uint16_t modbus_crc16_update(uint16_t crc, modbus_buffer_t* b, int len);
+
+#endif
\ No newline at end of file
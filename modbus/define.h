@@ -13,6 +13,10 @@
 #define MODBUS_OPCODE_WRITE_REGISTER (0x06)
 #define MODBUS_OPCODE_WRITE_COILS (0x0F)
 #define MODBUS_OPCODE_WRITE_REGISTERS (0x10)
+#define MODBUS_OPCODE_READ_FILE_RECORD (0x14)
+#define MODBUS_OPCODE_WRITE_FILE_RECORD (0x15)
+#define MODBUS_OPCODE_MASK_WRITE_REGISTER (0x16)
+#define MODBUS_OPCODE_READ_WRITE_REGISTERS (0x17)
 
 #define MODBUS_OPCODE_ERROR_MASK (0x80)
 #define MODBUS_OPCODE_FUNC_MASK (0x7F)
@@ -20,6 +24,13 @@
 #define MODBUS_WRITE_COIL_TRUE (0xFF00)
 #define MODBUS_WRITE_COIL_FALSE (0x0000)
 
+#define MODBUS_EXCEPTION_ILLEGAL_FUNCTION (0x01)
+#define MODBUS_EXCEPTION_ILLEGAL_ADDRESS (0x02)
+#define MODBUS_EXCEPTION_ILLEGAL_VALUE (0x03)
+#define MODBUS_EXCEPTION_SLAVE_BUSY (0x06)
+#define MODBUS_EXCEPTION_GATEWAY_PATH (0x0A)
+#define MODBUS_EXCEPTION_GATEWAY_TARGET (0x0B)
+
 #define MODBUS_OPCODE_IS_ERROR(op) \
   ((op & MODBUS_OPCODE_ERROR_MASK) == MODBUS_OPCODE_ERROR_MASK)
 
@@ -34,13 +45,33 @@
    (MODBUS_OPCODE_FUNC(op) == MODBUS_OPCODE_WRITE_REGISTER) ||         \
    (MODBUS_OPCODE_FUNC(op) == MODBUS_OPCODE_WRITE_COILS) ||            \
    (MODBUS_OPCODE_FUNC(op) == MODBUS_OPCODE_WRITE_REGISTERS) ||        \
+   (MODBUS_OPCODE_FUNC(op) == MODBUS_OPCODE_READ_FILE_RECORD) ||       \
+   (MODBUS_OPCODE_FUNC(op) == MODBUS_OPCODE_WRITE_FILE_RECORD) ||      \
+   (MODBUS_OPCODE_FUNC(op) == MODBUS_OPCODE_MASK_WRITE_REGISTER) ||    \
+   (MODBUS_OPCODE_FUNC(op) == MODBUS_OPCODE_READ_WRITE_REGISTERS) ||   \
    (MODBUS_OPCODE_IS_ERROR(op)))
 
 #define MODBUS_REQUEST_PAYLOAD_BIT(op) ((op == MODBUS_OPCODE_WRITE_COILS))
-#define MODBUS_REQUEST_PAYLOAD_U16(op) ((op == MODBUS_OPCODE_WRITE_REGISTERS))
+#define MODBUS_REQUEST_PAYLOAD_U16(op)      \
+  ((op == MODBUS_OPCODE_WRITE_REGISTERS) || \
+   (op == MODBUS_OPCODE_READ_WRITE_REGISTERS))
+
+// the request carries a second range, the one written before the read
+#define MODBUS_REQUEST_HAS_WRITE(op) \
+  ((op == MODBUS_OPCODE_READ_WRITE_REGISTERS))
+
+// and/or masks follow the address, in the request and its echo
+#define MODBUS_REQUEST_HAS_MASK(op) ((op == MODBUS_OPCODE_MASK_WRITE_REGISTER))
 
-#define MODBUS_REQUEST_HAS_PAYLOAD(op) \
-  (MODBUS_REQUEST_PAYLOAD_BIT(op) || (MODBUS_REQUEST_PAYLOAD_U16(op)))
+// file record frames are a byte count and sub-requests, no address or
+// length, the payload keeps them as they are on the wire
+#define MODBUS_REQUEST_PAYLOAD_RAW(op)       \
+  ((op == MODBUS_OPCODE_READ_FILE_RECORD) || \
+   (op == MODBUS_OPCODE_WRITE_FILE_RECORD))
+
+#define MODBUS_REQUEST_HAS_PAYLOAD(op)                                   \
+  (MODBUS_REQUEST_PAYLOAD_BIT(op) || (MODBUS_REQUEST_PAYLOAD_U16(op)) || \
+   (MODBUS_REQUEST_PAYLOAD_RAW(op)))
 
 #define MODBUS_REPLY_PAYLOAD_IS_BIT(op) \
   ((op == MODBUS_OPCODE_READ_COILS) ||  \
@@ -48,18 +79,42 @@
 
 #define MODBUS_REPLY_PAYLOAD_IS_U16(op)            \
   ((op == MODBUS_OPCODE_READ_HOLDING_REGISTERS) || \
-   (op == MODBUS_OPCODE_READ_INPUT_REGISTERS))
+   (op == MODBUS_OPCODE_READ_INPUT_REGISTERS) ||   \
+   (op == MODBUS_OPCODE_READ_WRITE_REGISTERS))
 
 #define MODBUS_REPLY_HAS_ATTR(op)                                              \
   ((op == MODBUS_OPCODE_WRITE_COIL) || (op == MODBUS_OPCODE_WRITE_REGISTER) || \
-   (op == MODBUS_OPCODE_WRITE_COILS) || (op == MODBUS_OPCODE_WRITE_REGISTERS))
+   (op == MODBUS_OPCODE_WRITE_COILS) ||                                        \
+   (op == MODBUS_OPCODE_WRITE_REGISTERS) ||                                    \
+   (op == MODBUS_OPCODE_MASK_WRITE_REGISTER))
+
+#define MODBUS_REPLY_PAYLOAD_IS_RAW(op) (MODBUS_REQUEST_PAYLOAD_RAW(op))
 
-#define MODBUS_REPLY_HAS_PAYLOAD(op) \
-  (MODBUS_REPLY_PAYLOAD_IS_BIT(op) || (MODBUS_REPLY_PAYLOAD_IS_U16(op)))
+#define MODBUS_REPLY_HAS_PAYLOAD(op)                                       \
+  (MODBUS_REPLY_PAYLOAD_IS_BIT(op) || (MODBUS_REPLY_PAYLOAD_IS_U16(op)) || \
+   (MODBUS_REPLY_PAYLOAD_IS_RAW(op)))
 
 #define MODBUS_BROADCAST_ADDRESS (0)
 #define MODBUS_PAYLOAD_BUFFER_SIZE (256)
 
+#ifndef MODBUS_POOL_BLOCKS
+#define MODBUS_POOL_BLOCKS (4)
+#endif
+
+// payload references the driver input buffer, valid until the hook returns
+#define MODBUS_PAYLOAD_VIEW (0x01)
+// payload is a block of the instance payload pool
+#define MODBUS_PAYLOAD_POOL (0x02)
+
+// decode request payloads as views instead of allocated copies
+#define MODBUS_FLAG_DECODE_VIEW (0x01)
+// replies are dropped, set while a broadcast runs
+#define MODBUS_FLAG_MUTE (0x02)
+// modbus_init allocated the socket driver inbuf, modbus_kill releases it
+#define MODBUS_FLAG_OWN_INBUF (0x04)
+
+#define MODBUS_UNIT_MAX (248)
+
 typedef enum {
   MODBUS_ROLE_SLAVE = 0,
   MODBUS_ROLE_MASTER = 1,
@@ -68,50 +123,116 @@ typedef enum {
 typedef void (*modbus_hook_t)(uint8_t addr, void *reqOrRep);
 typedef void (*modbus_free_t)(void *);
 
+typedef struct {
+  int capacity;
+  int used;
+  int peak;
+  // payloads that found the pool empty and were taken from the heap
+  int fallbacks;
+  uint8_t *blocks;
+  void *head;
+} modbus_pool_t;
+
+typedef struct {
+  uint8_t length;
+  uint8_t flag;
+  union {
+    uint8_t *u8;
+    uint16_t *u16;
+  };
+  modbus_pool_t *pool;
+} modbus_payload_t;
+
 typedef struct {
   uint8_t opcode;
   uint16_t address;
   union {
     uint16_t length;
     uint16_t value;
+    uint16_t and_mask;
   };
-  struct {
-    uint8_t length;
-    union {
-      uint8_t *u8;
-      uint16_t *u16;
-    };
-  } payload;
+  // read/write registers only, address and length above are the read range
+  // and the payload holds the registers written here
+  union {
+    uint16_t write_address;
+    uint16_t or_mask;
+  };
+  uint16_t write_length;
+  modbus_payload_t payload;
 } modbus_request_t;
 
+// same layout as the request, packages overlay both
 typedef struct {
   uint8_t opcode;
   uint16_t address;
   union {
     uint16_t length;
     uint16_t value;
+    uint16_t and_mask;
   };
-  struct {
-    uint8_t length;
-    union {
-      uint8_t *u8;
-      uint16_t *u16;
-    };
-  } payload;
+  // echoes the write range of a read/write registers request
+  union {
+    uint16_t write_address;
+    uint16_t or_mask;
+  };
+  uint16_t write_length;
+  modbus_payload_t payload;
 } modbus_reply_t;
 
+typedef struct {
+  bool busy;
+  uint8_t addr;
+  uint8_t opcode;
+  uint16_t transaction;
+  uint16_t address;
+  uint16_t length;
+  // millis when the request went out, a slot older than the timeout is
+  // taken back so lost replies cannot use up the table
+  uint32_t stamp;
+#if defined(MODBUS_STATS)
+  uint32_t sent;
+#endif
+} modbus_inflight_t;
+
+#ifndef MODBUS_INFLIGHT_TIMEOUT
+#define MODBUS_INFLIGHT_TIMEOUT (1000)
+#endif
+
 typedef struct {
   uint16_t transaction;
   uint16_t protocol;
+
+  // master only, up to inflight_len requests await their reply at once;
+  // a request takes slot transaction % inflight_len so replies are matched
+  // in any order without a search
+  uint16_t next;
+  uint16_t inflight_len;
+  uint16_t inflight_cnt;
+  modbus_inflight_t *inflight;
+  // milliseconds a reply is waited for, 0 uses MODBUS_INFLIGHT_TIMEOUT;
+  // expired counts the slots taken back, a late reply to one is dropped
+  uint32_t timeout;
+  uint32_t expired;
 } modbus_mbap_t;
 
 typedef struct {
   uint8_t addr;
+  uint8_t flag;
   union {
     modbus_request_t req;
     modbus_reply_t rep;
   };
+  modbus_pool_t *pool;
   void *extra;
+#if defined(MODBUS_STATS)
+  struct modbus_stats *stats;
+  // micros when the request behind a decoded reply went out, 0 if unknown
+  uint32_t sent;
+#endif
+#if defined(MODBUS_CAPTURE)
+  struct modbus_capture *capture;
+  uint16_t channel;
+#endif
 } modbus_package_t;
 
 typedef struct {
@@ -132,6 +253,13 @@ typedef struct {
   modbus_hook_t reserve14;
   modbus_hook_t write_coils;
   modbus_hook_t write_registers;
+  modbus_hook_t reserve17;
+  modbus_hook_t reserve18;
+  modbus_hook_t reserve19;
+  modbus_hook_t read_file_record;
+  modbus_hook_t write_file_record;
+  modbus_hook_t mask_write_register;
+  modbus_hook_t read_write_registers;
   modbus_hook_t forward;
 } modbus_hooks_t;
 
@@ -140,6 +268,17 @@ typedef struct {
   void (*kill)(void *this);
 } modbus_driver_t;
 
+// progress on the frame heading a driver input buffer, kept between idle
+// calls so arriving bytes are looked at once; clear it when the input
+// buffer is flushed from outside the parser
+typedef struct {
+  // frame length once its header was parsed, 0 before
+  int expect;
+  // leading bytes already folded into crc
+  int scanned;
+  uint16_t crc;
+} modbus_decoder_t;
+
 typedef struct {
   void (*init)(void *this);
   void (*kill)(void *this);
@@ -149,8 +288,18 @@ typedef struct {
 
   modbus_buffer_t inbuf;
   modbus_buffer_t oubuf;
+  modbus_decoder_t decoder;
+
+  // optional, microseconds since the last byte arrived; with baud set the
+  // parser waits for t3.5 of silence and decodes each frame exactly once
+  uint32_t (*silence)(void *this);
+  uint32_t baud;
 } modbus_driver_rtu_t;
 
+#ifndef MODBUS_SOCKET_INBUF_SIZE
+#define MODBUS_SOCKET_INBUF_SIZE (512)
+#endif
+
 typedef struct {
   void (*init)(void *this);
   void (*kill)(void *this);
@@ -158,6 +307,12 @@ typedef struct {
   int (*recv)(void *this, uint8_t *buf, int max);
   int (*send)(void *this, uint8_t *buf, int len);
 
+  // received bytes wait in inbuf until their frame is complete, it must
+  // hold at least one full frame; init sets it up, or leaves it zeroed and
+  // modbus_init allocates MODBUS_SOCKET_INBUF_SIZE bytes that modbus_kill
+  // releases; replies are encoded into cache
+  modbus_buffer_t inbuf;
+  modbus_decoder_t decoder;
   uint8_t *cache;
   uint16_t cache_len;
   uint8_t *extra;
@@ -170,25 +325,200 @@ typedef struct {
   };
 } modbus_driver_socket_t;
 
+typedef void (*modbus_changed_t)(void *arg, uint8_t opcode, uint16_t address,
+                                 uint16_t length);
+
+typedef struct {
+  uint16_t address;
+  uint16_t length;
+  union {
+    uint8_t *bits;
+    uint16_t *regs;
+  };
+} modbus_table_t;
+
+typedef struct {
+  // coils and discrete inputs are packed lsb first like their payloads
+  modbus_table_t coils;
+  modbus_table_t discrete_inputs;
+  modbus_table_t holding_registers;
+  modbus_table_t input_registers;
+
+  modbus_changed_t changed;
+  void *arg;
+} modbus_model_t;
+
+typedef struct {
+  modbus_hooks_t hooks;
+  modbus_model_t *model;
+  void *context;
+} modbus_unit_t;
+
+typedef void (*modbus_done_t)(void *arg, uint8_t status, uint8_t addr,
+                              modbus_reply_t *rep);
+
+typedef struct {
+  uint8_t addr;
+  uint8_t tries;
+  modbus_request_t req;
+  modbus_done_t done;
+  void *arg;
+} modbus_job_t;
+
+typedef struct {
+  // caller provided ring of queued requests, the head one is on the bus
+  modbus_job_t *jobs;
+  uint16_t jobs_len;
+  uint16_t head;
+  uint16_t count;
+
+  uint32_t timeout;
+  uint32_t turnaround;
+  uint8_t retries;
+
+  bool busy;
+  uint32_t sent;
+} modbus_master_t;
+
 typedef struct {
   bool (*decode)(modbus_role_t role, modbus_package_t *p, void *driver);
   bool (*encode)(modbus_role_t role, modbus_package_t *p, void *driver);
 } modbus_parser_t;
 
+typedef struct modbus_gateway modbus_gateway_t;
+
+#if defined(MODBUS_CAPTURE)
+typedef struct modbus_capture modbus_capture_t;
+#endif
+
+#if defined(MODBUS_STATS)
+// log2 microsecond buckets, bucket i holds [2^(i-1), 2^i) and 0 holds 0
+#define MODBUS_STATS_BUCKETS (24)
+
+typedef struct modbus_stats {
+  uint32_t decoded;
+  uint32_t encoded;
+  uint32_t crc_errors;
+  uint32_t dropped;
+  uint32_t exceptions;
+  uint32_t forwarded;
+  uint64_t hook_us;
+
+  // slave decode to reply, master request to reply, time inside hooks
+  uint32_t reply[MODBUS_STATS_BUCKETS];
+  uint32_t request[MODBUS_STATS_BUCKETS];
+  uint32_t hook[MODBUS_STATS_BUCKETS];
+} modbus_stats_t;
+#endif
+
 typedef struct {
   modbus_role_t role;
+  uint8_t flag;
   modbus_parser_t *parser;
   modbus_hooks_t hooks;
 
   void *driver;
   void *extra;
 
+  // capacity may be preset before modbus_init, 0 uses MODBUS_POOL_BLOCKS
+  modbus_pool_t pool;
+
+#if defined(MODBUS_STATS)
+  modbus_stats_t stats;
+  uint32_t decoded_at;
+  uint32_t sent_at;
+#endif
+
+#if defined(MODBUS_CAPTURE)
+  // frames seen by the parser are recorded here when set, tagged with
+  // channel to tell connections apart
+  modbus_capture_t *capture;
+  uint16_t channel;
+#endif
+
   union {
     struct {
       uint8_t addr;
+      modbus_model_t *model;
+      // MODBUS_UNIT_MAX entries indexed by unit id, replaces addr and model
+      modbus_unit_t **units;
+      // requests for units not served here are relayed by the gateway
+      modbus_gateway_t *gateway;
     } slave;
+    struct {
+      modbus_master_t *engine;
+    } master;
   };
 
 } modbus_t;
 
+typedef struct {
+  // rtu master with an engine attached, serves units first..last
+  modbus_t *modbus;
+  uint8_t first;
+  uint8_t last;
+  // queued requests allowed on the line, 0 leaves the engine as the limit
+  uint16_t depth;
+} modbus_gateway_line_t;
+
+typedef struct modbus_gateway_wait {
+  bool busy;
+  // identical reads share the transaction of the first, chained by next
+  bool joinable;
+  struct modbus_gateway_wait *next;
+  modbus_gateway_t *gateway;
+  // origin of the request, modbus is cleared once its connection is gone
+  modbus_t *modbus;
+  void *driver;
+  void *extra;
+  uint8_t addr;
+  uint8_t opcode;
+  uint16_t address;
+  uint16_t length;
+  uint16_t transaction;
+  uint16_t protocol;
+#if defined(MODBUS_CAPTURE)
+  uint16_t channel;
+#endif
+} modbus_gateway_wait_t;
+
+typedef struct {
+  // unit 0 matches every unit, first..last the requested start address
+  uint8_t addr;
+  uint16_t first;
+  uint16_t last;
+  uint32_t ttl;
+} modbus_gateway_ttl_t;
+
+typedef struct {
+  bool valid;
+  uint8_t addr;
+  uint8_t opcode;
+  uint16_t address;
+  uint16_t length;
+  uint32_t stamp;
+  uint8_t payload_len;
+  uint8_t payload[MODBUS_PAYLOAD_BUFFER_SIZE];
+} modbus_gateway_entry_t;
+
+struct modbus_gateway {
+  modbus_gateway_line_t *lines;
+  int lines_len;
+  // caller provided, one per request waiting for its line
+  modbus_gateway_wait_t *waits;
+  int waits_len;
+
+  // read replies cached by unit, opcode and range, direct mapped
+  modbus_gateway_entry_t *entries;
+  int entries_len;
+  modbus_gateway_ttl_t *ttls;
+  int ttls_len;
+  // milliseconds, used when no ttl rule matches, 0 disables caching
+  uint32_t ttl;
+  uint32_t hits;
+  uint32_t misses;
+  // reads answered by a transaction already in flight
+  uint32_t joined;
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,222 @@
+#include "file.h"
+
+#include "arch.h"
+#include "modbus.h"
+#include "swap.h"
+
+static uint16_t file_u16(uint8_t* p) { return (uint16_t)(p[0] << 8) | p[1]; }
+
+static void file_put16(uint8_t* p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+bool modbus_file_next(modbus_payload_t* payload, uint8_t opcode, bool reply,
+                      int* pos, modbus_file_record_t* rec) {
+  uint8_t* p = payload->u8 + *pos;
+  int left = payload->length - *pos;
+
+  // read sub-responses are a length, the reference and the registers
+  if (reply && opcode == MODBUS_OPCODE_READ_FILE_RECORD) {
+    if (left < 2 || p[0] < 3 || p[0] % 2 == 0 || p[0] >= left ||
+        p[1] != MODBUS_FILE_REFERENCE) {
+      return false;
+    }
+
+    rec->file = 0;
+    rec->record = 0;
+    rec->length = (p[0] - 1) / 2;
+    rec->data = p + 2;
+    *pos += 1 + p[0];
+    return true;
+  }
+
+  if (left < 7 || p[0] != MODBUS_FILE_REFERENCE) {
+    return false;
+  }
+
+  rec->file = file_u16(p + 1);
+  rec->record = file_u16(p + 3);
+  rec->length = file_u16(p + 5);
+  rec->data = 0;
+
+  if (rec->length == 0 ||
+      (uint32_t)rec->record + rec->length > MODBUS_FILE_MAX_RECORD + 1) {
+    return false;
+  }
+
+  int size = 7;
+  if (opcode == MODBUS_OPCODE_WRITE_FILE_RECORD) {
+    size += rec->length * 2;
+    if (size > left) return false;
+    rec->data = p + 7;
+  }
+
+  *pos += size;
+  return true;
+}
+
+bool modbus_file_append(modbus_payload_t* payload, uint8_t opcode, bool reply,
+                        modbus_file_record_t* rec, uint16_t* regs) {
+  uint8_t* p = payload->u8 + payload->length;
+  bool read = opcode == MODBUS_OPCODE_READ_FILE_RECORD;
+
+  int size = 7 + rec->length * 2;
+  if (read) size = reply ? 2 + rec->length * 2 : 7;
+  if (payload->length + size > MODBUS_FILE_MAX_BYTES) {
+    return false;
+  }
+
+  if (read && reply) {
+    p[0] = 1 + rec->length * 2;
+    p[1] = MODBUS_FILE_REFERENCE;
+    rec->data = p + 2;
+  } else {
+    p[0] = MODBUS_FILE_REFERENCE;
+    file_put16(p + 1, rec->file);
+    file_put16(p + 3, rec->record);
+    file_put16(p + 5, rec->length);
+    rec->data = read ? 0 : p + 7;
+  }
+
+  if (rec->data) {
+    modbus_swap16_store(rec->data, regs, rec->length);
+  }
+
+  payload->length += size;
+  return true;
+}
+
+void modbus_file_load(modbus_file_record_t* rec, uint16_t* regs) {
+  modbus_swap16_load(regs, rec->data, rec->length);
+}
+
+void modbus_file_echo(modbus_reply_t* rep, modbus_request_t* req) {
+  modbus_reply_init(rep, req);
+  modbus_arch_memcpy(rep->payload.u8, req->payload.u8, req->payload.length);
+  rep->payload.length = req->payload.length;
+}
+
+static uint16_t file_span(modbus_file_transfer_t* t) {
+  uint32_t span = MODBUS_FILE_WRITE_MAX;
+  if (t->opcode == MODBUS_OPCODE_READ_FILE_RECORD) {
+    span = MODBUS_FILE_READ_MAX;
+  }
+
+  // a sub-request never runs past the last record of its file
+  uint32_t room = MODBUS_FILE_MAX_RECORD + 1 - t->record;
+  uint32_t left = t->count - t->moved;
+  if (t->max && t->max < span) span = t->max;
+  if (room < span) span = room;
+  if (left < span) span = left;
+  return span;
+}
+
+static void file_done(void* arg, uint8_t status, uint8_t addr,
+                      modbus_reply_t* rep);
+
+static uint8_t file_queue(modbus_file_transfer_t* t) {
+  modbus_file_record_t rec;
+  modbus_request_t req;
+  uint16_t regs[MODBUS_FILE_READ_MAX];
+
+  rec.file = t->file;
+  rec.record = t->record;
+  rec.length = file_span(t);
+
+  if (t->opcode == MODBUS_OPCODE_WRITE_FILE_RECORD &&
+      !t->chunk(t->arg, rec.file, rec.record, regs, rec.length)) {
+    return MODBUS_FILE_ABORTED;
+  }
+
+  modbus_request_init_pool(&req, t->opcode, t->modbus);
+  modbus_file_append(&req.payload, t->opcode, false, &rec, regs);
+
+  if (!modbus_master_submit(t->modbus, &req, t->addr, file_done, t)) {
+    modbus_request_free(&req);
+    return MODBUS_FILE_ABORTED;
+  }
+
+  t->pending = rec.length;
+  return 0;
+}
+
+static uint8_t file_reply(modbus_file_transfer_t* t, uint8_t status,
+                          modbus_reply_t* rep) {
+  if (status == MODBUS_DONE_TIMEOUT) return MODBUS_FILE_TIMEOUT;
+  if (status == MODBUS_DONE_FAILED) return MODBUS_FILE_ABORTED;
+  if (status == MODBUS_DONE_BROADCAST) return 0;
+  if (MODBUS_OPCODE_IS_ERROR(rep->opcode)) return rep->payload.u8[0];
+
+  // a write is echoed, only its size is checked
+  if (t->opcode == MODBUS_OPCODE_WRITE_FILE_RECORD) {
+    if (rep->payload.length != 7 + t->pending * 2) {
+      return MODBUS_FILE_MALFORMED;
+    }
+    return 0;
+  }
+
+  modbus_file_record_t rec;
+  uint16_t regs[MODBUS_FILE_READ_MAX];
+  int pos = 0;
+  if (!modbus_file_next(&rep->payload, t->opcode, true, &pos, &rec) ||
+      rec.length != t->pending) {
+    return MODBUS_FILE_MALFORMED;
+  }
+
+  modbus_file_load(&rec, regs);
+  if (!t->chunk(t->arg, t->file, t->record, regs, rec.length)) {
+    return MODBUS_FILE_ABORTED;
+  }
+
+  return 0;
+}
+
+static void file_done(void* arg, uint8_t status, uint8_t addr,
+                      modbus_reply_t* rep) {
+  modbus_file_transfer_t* t = arg;
+
+  uint8_t error = file_reply(t, status, rep);
+  if (!error) {
+    t->moved += t->pending;
+    t->record += t->pending;
+    if (t->record > MODBUS_FILE_MAX_RECORD) {
+      t->file++;
+      t->record = 0;
+    }
+    t->pending = 0;
+
+    if (t->moved == t->count) {
+      if (t->done) t->done(t->arg, 0);
+      return;
+    }
+
+    error = file_queue(t);
+  }
+
+  if (error && t->done) {
+    t->done(t->arg, error);
+  }
+}
+
+bool modbus_file_submit(modbus_file_transfer_t* t, modbus_t* m) {
+  if (t->opcode != MODBUS_OPCODE_READ_FILE_RECORD &&
+      t->opcode != MODBUS_OPCODE_WRITE_FILE_RECORD) {
+    return false;
+  }
+
+  // a broadcast read brings nothing back
+  if (t->opcode == MODBUS_OPCODE_READ_FILE_RECORD &&
+      t->addr == MODBUS_BROADCAST_ADDRESS) {
+    return false;
+  }
+
+  if (t->count == 0 || !t->chunk || t->record > MODBUS_FILE_MAX_RECORD) {
+    return false;
+  }
+
+  t->modbus = m;
+  t->moved = 0;
+  t->pending = 0;
+  return file_queue(t) == 0;
+}
\ No newline at end of file
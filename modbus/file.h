@@ -0,0 +1,75 @@
+#ifndef __MODBUS_FILE_H__
+#define __MODBUS_FILE_H__
+
+#include "define.h"
+
+// file records are registers addressed by a file and a record number, a
+// frame carries several sub-requests in a byte count of at most 0xF5
+#define MODBUS_FILE_REFERENCE (0x06)
+#define MODBUS_FILE_MAX_RECORD (9999)
+#define MODBUS_FILE_MAX_BYTES (0xF5)
+
+// registers of a lone sub-request filling a whole frame
+#define MODBUS_FILE_READ_MAX (121)
+#define MODBUS_FILE_WRITE_MAX (119)
+
+// errors of a transfer besides the exception codes, aborted also covers a
+// request that could not be sent
+#define MODBUS_FILE_TIMEOUT (0xFF)
+#define MODBUS_FILE_ABORTED (0xFE)
+#define MODBUS_FILE_MALFORMED (0xFD)
+
+typedef struct {
+  uint16_t file;
+  uint16_t record;
+  uint16_t length;
+  // big endian registers inside the frame, 0 for a read sub-request
+  uint8_t* data;
+} modbus_file_record_t;
+
+// chunk gets the registers a read brought, or fills the ones a write sends,
+// and stops the transfer by returning false
+typedef bool (*modbus_file_chunk_t)(void* arg, uint16_t file, uint16_t record,
+                                    uint16_t* regs, uint16_t count);
+typedef void (*modbus_file_done_t)(void* arg, uint8_t error);
+
+typedef struct {
+  uint8_t addr;
+  uint8_t opcode;
+  uint16_t file;
+  uint16_t record;
+  uint32_t count;
+  // registers per frame, 0 fills the frame
+  uint16_t max;
+  modbus_file_chunk_t chunk;
+  modbus_file_done_t done;
+  void* arg;
+
+  // progress, a transfer crosses into the next file after the last record
+  modbus_t* modbus;
+  uint32_t moved;
+  uint16_t pending;
+} modbus_file_transfer_t;
+
+// walks the sub-requests of a request or the sub-responses of a reply, pos
+// starts at 0 and stops short of the payload length on a malformed one;
+// read sub-responses only carry length and data
+bool modbus_file_next(modbus_payload_t* payload, uint8_t opcode, bool reply,
+                      int* pos, modbus_file_record_t* rec);
+
+// adds a sub-request or sub-response, regs are host order and ignored by
+// read sub-requests
+bool modbus_file_append(modbus_payload_t* payload, uint8_t opcode, bool reply,
+                        modbus_file_record_t* rec, uint16_t* regs);
+
+void modbus_file_load(modbus_file_record_t* rec, uint16_t* regs);
+
+// a write file record reply echoes the request
+void modbus_file_echo(modbus_reply_t* rep, modbus_request_t* req);
+
+// moves count registers from file and record on, which advance as frames
+// complete, with one frame in flight; chunk runs once per frame so a file is
+// never held whole; false when nothing was queued, otherwise done tells
+bool modbus_file_submit(modbus_file_transfer_t* t, modbus_t* m);
+
+#endif
\ No newline at end of file
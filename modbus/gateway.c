@@ -0,0 +1,404 @@
+#include "gateway.h"
+
+#include "arch.h"
+#include "modbus.h"
+
+static modbus_gateway_line_t* gateway_route(modbus_gateway_t* g,
+                                            uint8_t addr) {
+  for (int i = 0; i < g->lines_len; i++) {
+    modbus_gateway_line_t* line = &g->lines[i];
+    if (addr >= line->first && addr <= line->last) {
+      return line;
+    }
+  }
+
+  return 0;
+}
+
+static modbus_gateway_wait_t* gateway_acquire(modbus_gateway_t* g) {
+  for (int i = 0; i < g->waits_len; i++) {
+    if (!g->waits[i].busy) {
+      return &g->waits[i];
+    }
+  }
+
+  return 0;
+}
+
+static bool gateway_is_read(uint8_t opcode) {
+  return opcode == MODBUS_OPCODE_READ_COILS ||
+         opcode == MODBUS_OPCODE_DISCRETE_INPUTS ||
+         opcode == MODBUS_OPCODE_READ_HOLDING_REGISTERS ||
+         opcode == MODBUS_OPCODE_READ_INPUT_REGISTERS;
+}
+
+static uint32_t gateway_ttl(modbus_gateway_t* g, uint8_t addr,
+                            uint16_t address) {
+  for (int i = 0; i < g->ttls_len; i++) {
+    modbus_gateway_ttl_t* rule = &g->ttls[i];
+    if ((rule->addr == 0 || rule->addr == addr) && address >= rule->first &&
+        address <= rule->last) {
+      return rule->ttl;
+    }
+  }
+
+  return g->ttl;
+}
+
+static modbus_gateway_entry_t* gateway_entry(modbus_gateway_t* g,
+                                             uint8_t addr, uint8_t opcode,
+                                             uint16_t address,
+                                             uint16_t length) {
+  uint32_t key = (uint32_t)addr << 24 | (uint32_t)opcode << 16 | address;
+  uint32_t hash = (key ^ (uint32_t)length << 7) * 2654435761u;
+  return &g->entries[hash % g->entries_len];
+}
+
+static bool gateway_cached(modbus_gateway_t* g, modbus_t* m,
+                           modbus_package_t* p) {
+  modbus_request_t* req = &p->req;
+  if (g->entries_len == 0 || !gateway_is_read(req->opcode)) {
+    return false;
+  }
+
+  uint32_t ttl = gateway_ttl(g, p->addr, req->address);
+  if (ttl == 0) {
+    return false;
+  }
+
+  modbus_gateway_entry_t* e =
+      gateway_entry(g, p->addr, req->opcode, req->address, req->length);
+  if (!e->valid || e->addr != p->addr || e->opcode != req->opcode ||
+      e->address != req->address || e->length != req->length ||
+      (uint32_t)(modbus_arch_millis() - e->stamp) >= ttl) {
+    g->misses++;
+    return false;
+  }
+
+  g->hits++;
+
+  modbus_reply_t rep;
+  modbus_reply_init(&rep, req);
+  modbus_arch_memcpy(rep.payload.u8, e->payload, e->payload_len);
+  rep.payload.length = e->payload_len;
+  modbus_reply_send(&rep, p->addr, m);
+  modbus_reply_free(&rep);
+  return true;
+}
+
+static void gateway_store(modbus_gateway_t* g, modbus_gateway_wait_t* w,
+                          modbus_reply_t* rep) {
+  if (g->entries_len == 0 || !gateway_is_read(w->opcode) ||
+      MODBUS_OPCODE_IS_ERROR(rep->opcode)) {
+    return;
+  }
+
+  if (gateway_ttl(g, w->addr, w->address) == 0) {
+    return;
+  }
+
+  modbus_gateway_entry_t* e =
+      gateway_entry(g, w->addr, w->opcode, w->address, w->length);
+  e->valid = true;
+  e->addr = w->addr;
+  e->opcode = w->opcode;
+  e->address = w->address;
+  e->length = w->length;
+  e->stamp = modbus_arch_millis();
+  e->payload_len = rep->payload.length;
+  modbus_arch_memcpy(e->payload, rep->payload.u8, rep->payload.length);
+}
+
+static bool gateway_target(uint8_t opcode, uint8_t* read, uint16_t* length) {
+  if (opcode == MODBUS_OPCODE_WRITE_COIL ||
+      opcode == MODBUS_OPCODE_WRITE_COILS) {
+    *read = MODBUS_OPCODE_READ_COILS;
+  } else if (opcode == MODBUS_OPCODE_WRITE_REGISTER ||
+             opcode == MODBUS_OPCODE_WRITE_REGISTERS ||
+             opcode == MODBUS_OPCODE_MASK_WRITE_REGISTER ||
+             opcode == MODBUS_OPCODE_READ_WRITE_REGISTERS) {
+    *read = MODBUS_OPCODE_READ_HOLDING_REGISTERS;
+  } else {
+    return false;
+  }
+
+  // single writes carry the value where multiple writes carry a count
+  if (opcode == MODBUS_OPCODE_WRITE_COIL ||
+      opcode == MODBUS_OPCODE_WRITE_REGISTER ||
+      opcode == MODBUS_OPCODE_MASK_WRITE_REGISTER) {
+    *length = 1;
+  }
+
+  return true;
+}
+
+static bool gateway_overlap(uint16_t a, uint16_t a_len, uint16_t b,
+                            uint16_t b_len) {
+  return a < (uint32_t)b + b_len && b < (uint32_t)a + a_len;
+}
+
+static void gateway_invalidate(modbus_gateway_t* g, uint8_t addr,
+                               uint8_t opcode, uint16_t address,
+                               uint16_t length) {
+  uint8_t read;
+  if (!gateway_target(opcode, &read, &length)) {
+    return;
+  }
+
+  for (int i = 0; i < g->entries_len; i++) {
+    modbus_gateway_entry_t* e = &g->entries[i];
+    if (!e->valid || e->opcode != read) continue;
+    if (addr != MODBUS_BROADCAST_ADDRESS && e->addr != addr) continue;
+
+    if (gateway_overlap(e->address, e->length, address, length)) {
+      e->valid = false;
+    }
+  }
+
+  // reads queued before the write must not answer reads sent after it
+  for (int i = 0; i < g->waits_len; i++) {
+    modbus_gateway_wait_t* w = &g->waits[i];
+    if (!w->busy || w->opcode != read) continue;
+    if (addr != MODBUS_BROADCAST_ADDRESS && w->addr != addr) continue;
+
+    if (gateway_overlap(w->address, w->length, address, length)) {
+      w->joinable = false;
+    }
+  }
+}
+
+static modbus_gateway_wait_t* gateway_flight(modbus_gateway_t* g,
+                                             modbus_gateway_wait_t* wait) {
+  if (!gateway_is_read(wait->opcode)) {
+    return 0;
+  }
+
+  for (int i = 0; i < g->waits_len; i++) {
+    modbus_gateway_wait_t* w = &g->waits[i];
+    if (w->busy && w->joinable && w->addr == wait->addr &&
+        w->opcode == wait->opcode && w->address == wait->address &&
+        w->length == wait->length) {
+      return w;
+    }
+  }
+
+  return 0;
+}
+
+static void gateway_copy(modbus_request_t* dst, modbus_request_t* src) {
+  modbus_arch_memcpy(dst, src, sizeof(modbus_request_t));
+
+  if (MODBUS_REQUEST_HAS_PAYLOAD(src->opcode)) {
+    modbus_payload_alloc(&dst->payload);
+    modbus_arch_memcpy(dst->payload.u8, src->payload.u8, src->payload.length);
+  }
+}
+
+static void gateway_reply(modbus_gateway_wait_t* w, modbus_reply_t* rep) {
+  modbus_t* m = w->modbus;
+  void* driver = m->driver;
+  void* extra = m->extra;
+#if defined(MODBUS_CAPTURE)
+  uint16_t channel = m->channel;
+  m->channel = w->channel;
+#endif
+
+  // answer on the connection the request came from with its own id
+  m->driver = w->driver;
+  m->extra = w->extra;
+
+  modbus_mbap_t* mbap = w->extra;
+  if (mbap) {
+    mbap->transaction = w->transaction;
+    mbap->protocol = w->protocol;
+  }
+
+  modbus_reply_send(rep, w->addr, m);
+
+  m->driver = driver;
+  m->extra = extra;
+#if defined(MODBUS_CAPTURE)
+  m->channel = channel;
+#endif
+}
+
+static void gateway_error(modbus_gateway_wait_t* w, uint8_t code) {
+  modbus_request_t req;
+  modbus_reply_t rep;
+
+  modbus_arch_memset(&req, 0, sizeof(modbus_request_t));
+  req.opcode = w->opcode;
+  req.payload.pool = &w->modbus->pool;
+
+  modbus_error_init(&rep, &req, code);
+  gateway_reply(w, &rep);
+  modbus_reply_free(&rep);
+}
+
+static void gateway_done(void* arg, uint8_t status, uint8_t addr,
+                         modbus_reply_t* rep) {
+  modbus_gateway_wait_t* w = arg;
+
+  // a write queued behind a read may have outdated what the read cached
+  gateway_invalidate(w->gateway, w->addr, w->opcode, w->address, w->length);
+  if (status == MODBUS_DONE_REPLY) {
+    gateway_store(w->gateway, w, rep);
+  }
+
+  // every waiter gets the reply under its own transaction id
+  while (w) {
+    modbus_gateway_wait_t* next = w->next;
+
+    if (w->modbus) {
+      if (status == MODBUS_DONE_REPLY) {
+        gateway_reply(w, rep);
+      } else {
+        gateway_error(w, MODBUS_EXCEPTION_GATEWAY_TARGET);
+      }
+    }
+
+    w->busy = false;
+    w->next = 0;
+    w = next;
+  }
+}
+
+static void gateway_broadcast(modbus_gateway_t* g, modbus_package_t* p) {
+  for (int i = 0; i < g->lines_len; i++) {
+    modbus_request_t req;
+    gateway_copy(&req, &p->req);
+
+    if (!modbus_master_submit(g->lines[i].modbus, &req, p->addr, 0, 0)) {
+      modbus_request_free(&req);
+    }
+  }
+}
+
+void modbus_gateway_init(modbus_gateway_t* g, modbus_gateway_line_t* lines,
+                         int lines_len, modbus_gateway_wait_t* waits,
+                         int waits_len) {
+  g->lines = lines;
+  g->lines_len = lines_len;
+  g->waits = waits;
+  g->waits_len = waits_len;
+  g->entries = 0;
+  g->entries_len = 0;
+  g->ttls = 0;
+  g->ttls_len = 0;
+  g->ttl = 0;
+  g->hits = 0;
+  g->misses = 0;
+  g->joined = 0;
+
+  modbus_arch_memset(waits, 0, waits_len * sizeof(modbus_gateway_wait_t));
+}
+
+void modbus_gateway_cache(modbus_gateway_t* g, modbus_gateway_entry_t* entries,
+                          int entries_len, uint32_t ttl,
+                          modbus_gateway_ttl_t* ttls, int ttls_len) {
+  g->entries = entries;
+  g->entries_len = entries_len;
+  g->ttl = ttl;
+  g->ttls = ttls;
+  g->ttls_len = ttls_len;
+
+  for (int i = 0; i < entries_len; i++) {
+    entries[i].valid = false;
+  }
+}
+
+bool modbus_gateway_forward(modbus_t* m, modbus_package_t* p) {
+  modbus_gateway_t* g = m->slave.gateway;
+  modbus_request_t* req = &p->req;
+
+  // a read/write request outdates its write range, the read is not cached
+  uint16_t address = req->address;
+  uint16_t length = req->length;
+  if (MODBUS_REQUEST_HAS_WRITE(req->opcode)) {
+    address = req->write_address;
+    length = req->write_length;
+  }
+
+  gateway_invalidate(g, p->addr, req->opcode, address, length);
+
+  if (p->addr == MODBUS_BROADCAST_ADDRESS) {
+    gateway_broadcast(g, p);
+    return true;
+  }
+
+  modbus_gateway_wait_t wait;
+  modbus_arch_memset(&wait, 0, sizeof(modbus_gateway_wait_t));
+  wait.busy = true;
+  wait.joinable = true;
+  wait.gateway = g;
+  wait.modbus = m;
+  wait.driver = m->driver;
+  wait.extra = m->extra;
+#if defined(MODBUS_CAPTURE)
+  wait.channel = m->channel;
+#endif
+  wait.addr = p->addr;
+  wait.opcode = req->opcode;
+  wait.address = address;
+  wait.length = length;
+
+  modbus_mbap_t* mbap = m->extra;
+  if (mbap) {
+    wait.transaction = mbap->transaction;
+    wait.protocol = mbap->protocol;
+  }
+
+  modbus_gateway_line_t* line = gateway_route(g, p->addr);
+  if (!line) {
+    gateway_error(&wait, MODBUS_EXCEPTION_GATEWAY_PATH);
+    return false;
+  }
+
+  if (gateway_cached(g, m, p)) {
+    return true;
+  }
+
+  modbus_gateway_wait_t* w = gateway_acquire(g);
+  if (!w) {
+    gateway_error(&wait, MODBUS_EXCEPTION_SLAVE_BUSY);
+    return false;
+  }
+
+  modbus_gateway_wait_t* flight = gateway_flight(g, &wait);
+  if (flight) {
+    modbus_arch_memcpy(w, &wait, sizeof(modbus_gateway_wait_t));
+    w->next = flight->next;
+    flight->next = w;
+    g->joined++;
+    return true;
+  }
+
+  modbus_master_t* q = line->modbus->master.engine;
+  if (line->depth && q->count >= line->depth) {
+    gateway_error(&wait, MODBUS_EXCEPTION_SLAVE_BUSY);
+    return false;
+  }
+
+  // a view dies with the input buffer, the line needs its own copy
+  modbus_request_t copy;
+  gateway_copy(&copy, req);
+
+  modbus_arch_memcpy(w, &wait, sizeof(modbus_gateway_wait_t));
+  if (!modbus_master_submit(line->modbus, &copy, p->addr, gateway_done, w)) {
+    modbus_request_free(&copy);
+    w->busy = false;
+    gateway_error(&wait, MODBUS_EXCEPTION_SLAVE_BUSY);
+    return false;
+  }
+
+  return true;
+}
+
+void modbus_gateway_drop(modbus_gateway_t* g, void* driver) {
+  for (int i = 0; i < g->waits_len; i++) {
+    modbus_gateway_wait_t* w = &g->waits[i];
+    if (w->busy && w->driver == driver) {
+      w->modbus = 0;
+    }
+  }
+}
\ No newline at end of file
@@ -0,0 +1,25 @@
+#ifndef __MODBUS_GATEWAY_H__
+#define __MODBUS_GATEWAY_H__
+
+#include "define.h"
+
+// relays requests of a tcp slave to the rtu lines behind it, attach with
+// m->slave.gateway and run modbus_idle on every line
+
+void modbus_gateway_init(modbus_gateway_t* g, modbus_gateway_line_t* lines,
+                         int lines_len, modbus_gateway_wait_t* waits,
+                         int waits_len);
+
+// entries is the bounded reply cache, ttls optional per unit/range rules
+void modbus_gateway_cache(modbus_gateway_t* g, modbus_gateway_entry_t* entries,
+                          int entries_len, uint32_t ttl,
+                          modbus_gateway_ttl_t* ttls, int ttls_len);
+
+// relays a copy of p->req, which stays with the caller, answers with an
+// exception when no line can take it
+bool modbus_gateway_forward(modbus_t* m, modbus_package_t* p);
+
+// replies still pending for driver are discarded
+void modbus_gateway_drop(modbus_gateway_t* g, void* driver);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,148 @@
+#include "master.h"
+
+#include "arch.h"
+#include "modbus.h"
+
+static bool master_elapsed(modbus_master_t* q, uint32_t ms) {
+  return (uint32_t)(modbus_arch_millis() - q->sent) >= ms;
+}
+
+static bool master_send(modbus_t* m, modbus_job_t* job) {
+  modbus_master_t* q = m->master.engine;
+
+  // on a serial line a late reply is only told apart by what it carries
+  if (m->parser == &modbus_parser_rtu) {
+    modbus_rtu_flush(m->driver);
+  }
+
+  job->tries++;
+  q->busy = true;
+  q->sent = modbus_arch_millis();
+  return modbus_request_send(&job->req, job->addr, m);
+}
+
+static void master_done(modbus_t* m, uint8_t status, modbus_reply_t* rep) {
+  modbus_master_t* q = m->master.engine;
+  modbus_job_t job;
+
+  // done may queue the next request into the slot being released
+  modbus_arch_memcpy(&job, &q->jobs[q->head], sizeof(modbus_job_t));
+  q->busy = false;
+  q->head = (q->head + 1) % q->jobs_len;
+  q->count--;
+
+  if (job.done) {
+    job.done(job.arg, status, job.addr, rep);
+  }
+
+  modbus_request_free(&job.req);
+}
+
+void modbus_master_init(modbus_master_t* q, modbus_job_t* jobs, int len) {
+  modbus_arch_memset(q, 0, sizeof(modbus_master_t));
+
+  q->jobs = jobs;
+  q->jobs_len = len;
+  q->timeout = MODBUS_MASTER_TIMEOUT;
+  q->turnaround = MODBUS_MASTER_TURNAROUND;
+  q->retries = MODBUS_MASTER_RETRIES;
+}
+
+bool modbus_master_submit(modbus_t* m, modbus_request_t* req, uint8_t addr,
+                          modbus_done_t done, void* arg) {
+  modbus_master_t* q = m->master.engine;
+  if (q->count == q->jobs_len) {
+    return false;
+  }
+
+  modbus_job_t* job = &q->jobs[(q->head + q->count) % q->jobs_len];
+  modbus_arch_memcpy(&job->req, req, sizeof(modbus_request_t));
+  job->addr = addr;
+  job->tries = 0;
+  job->done = done;
+  job->arg = arg;
+  q->count++;
+
+  modbus_arch_memset(req, 0, sizeof(modbus_request_t));
+  return true;
+}
+
+void modbus_master_idle(modbus_t* m) {
+  modbus_master_t* q = m->master.engine;
+
+  while (q->count) {
+    modbus_job_t* job = &q->jobs[q->head];
+
+    // a request that could not even be encoded fails without waiting out
+    // the timeout, sending it again would fail the same way
+    if (!q->busy) {
+      if (master_send(m, job)) return;
+      master_done(m, MODBUS_DONE_FAILED, 0);
+      continue;
+    }
+
+    // a broadcast is never answered, only give the slaves time to act
+    if (job->addr == MODBUS_BROADCAST_ADDRESS) {
+      if (!master_elapsed(q, q->turnaround)) return;
+      master_done(m, MODBUS_DONE_BROADCAST, 0);
+      continue;
+    }
+
+    if (!master_elapsed(q, q->timeout)) return;
+
+    if (job->tries <= q->retries) {
+      if (master_send(m, job)) return;
+      master_done(m, MODBUS_DONE_FAILED, 0);
+      continue;
+    }
+
+    master_done(m, MODBUS_DONE_TIMEOUT, 0);
+  }
+}
+
+static bool master_count_ok(modbus_job_t* job, modbus_reply_t* rep) {
+  uint8_t opcode = job->req.opcode;
+  if (MODBUS_OPCODE_IS_ERROR(rep->opcode)) {
+    return true;
+  }
+
+  if (MODBUS_REPLY_PAYLOAD_IS_BIT(opcode)) {
+    return rep->payload.length == (job->req.length + 7) / 8;
+  }
+
+  if (MODBUS_REPLY_PAYLOAD_IS_U16(opcode)) {
+    return rep->payload.length == job->req.length * 2;
+  }
+
+  return true;
+}
+
+bool modbus_master_reply(modbus_t* m, modbus_package_t* p) {
+  modbus_master_t* q = m->master.engine;
+  if (!q->busy || q->count == 0) {
+    return false;
+  }
+
+  modbus_job_t* job = &q->jobs[q->head];
+  if (job->addr != p->addr ||
+      job->req.opcode != MODBUS_OPCODE_FUNC(p->rep.opcode)) {
+    return false;
+  }
+
+  // a read reply of another size answers an earlier request, it is dropped
+  // and the job keeps waiting
+  if (!master_count_ok(job, &p->rep)) {
+    modbus_reply_free(&p->rep);
+    return true;
+  }
+
+  // read replies do not echo their range, report the requested one
+  if (!MODBUS_REPLY_HAS_ATTR(job->req.opcode)) {
+    p->rep.address = job->req.address;
+    p->rep.length = job->req.length;
+  }
+
+  master_done(m, MODBUS_DONE_REPLY, &p->rep);
+  modbus_reply_free(&p->rep);
+  return true;
+}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#ifndef __MODBUS_MASTER_H__
+#define __MODBUS_MASTER_H__
+
+#include "define.h"
+
+#ifndef MODBUS_MASTER_TIMEOUT
+#define MODBUS_MASTER_TIMEOUT (1000)
+#endif
+
+#ifndef MODBUS_MASTER_TURNAROUND
+#define MODBUS_MASTER_TURNAROUND (100)
+#endif
+
+#ifndef MODBUS_MASTER_RETRIES
+#define MODBUS_MASTER_RETRIES (2)
+#endif
+
+#define MODBUS_DONE_REPLY (0)
+#define MODBUS_DONE_TIMEOUT (1)
+#define MODBUS_DONE_BROADCAST (2)
+// the request could not be sent, no reply will come
+#define MODBUS_DONE_FAILED (3)
+
+void modbus_master_init(modbus_master_t* q, modbus_job_t* jobs, int len);
+
+// queues req, which is owned by the queue from now on; done runs from
+// modbus_idle once the reply arrived or every retry timed out
+bool modbus_master_submit(modbus_t* m, modbus_request_t* req, uint8_t addr,
+                          modbus_done_t done, void* arg);
+
+void modbus_master_idle(modbus_t* m);
+bool modbus_master_reply(modbus_t* m, modbus_package_t* p);
+
+#endif
\ No newline at end of file
@@ -1,63 +1,176 @@
 #include "modbus.h"
 
-static void hook_noop(uint8_t addr, void *) {}
+#include <stddef.h>
 
-static void hook_run(modbus_t *m, modbus_package_t *p) {
-  modbus_hook_t *hooks = (modbus_hook_t *)&m->hooks;
-  modbus_hook_t hook_func = 0;
-  modbus_free_t free_func = 0;
-  void *hook_arg;
+static modbus_hook_t hook_find(modbus_hooks_t *hooks, uint8_t opcode) {
+  int func = MODBUS_OPCODE_FUNC(opcode);
 
-  if (m->role == MODBUS_ROLE_SLAVE) {
-    modbus_hook_t forward_func = hook_noop;
-    if (m->hooks.forward) {
-      forward_func = (modbus_hook_t)m->hooks.forward;
-    }
+  // every slot before forward belongs to the function code of its index
+  int slots = offsetof(modbus_hooks_t, forward) / sizeof(modbus_hook_t);
+  if (func >= slots) {
+    return 0;
+  }
+
+  return ((modbus_hook_t *)hooks)[func];
+}
+
+// addr is the unit running the request, which differs from p->addr for a
+// broadcast executed by every unit
+static void slave_run(modbus_t *m, modbus_package_t *p, uint8_t addr,
+                      modbus_hooks_t *hooks, modbus_model_t *model) {
+  if (model && modbus_model_serve(m, model, p)) {
+    return;
+  }
+
+  modbus_hook_t hook_func = hook_find(hooks, p->req.opcode);
+  if (hook_func) {
+    return hook_func(addr, &p->req);
+  }
+
+  modbus_reply_t rep;
+  modbus_error_init(&rep, &p->req, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+  modbus_reply_send(&rep, addr, m);
+  modbus_reply_free(&rep);
+}
+
+static void slave_broadcast(modbus_t *m, modbus_package_t *p) {
+  uint8_t opcode = p->req.opcode;
+  if (opcode != MODBUS_OPCODE_WRITE_COIL &&
+      opcode != MODBUS_OPCODE_WRITE_REGISTER &&
+      opcode != MODBUS_OPCODE_WRITE_COILS &&
+      opcode != MODBUS_OPCODE_WRITE_REGISTERS &&
+      opcode != MODBUS_OPCODE_WRITE_FILE_RECORD &&
+      opcode != MODBUS_OPCODE_MASK_WRITE_REGISTER) {
+    return;
+  }
+
+  // broadcasts are executed by every unit but never answered
+  m->flag |= MODBUS_FLAG_MUTE;
+
+  if (!m->slave.units) {
+    slave_run(m, p, p->addr, &m->hooks, m->slave.model);
+  }
 
-    if (m->slave.addr != p->addr) {
-      forward_func(p->addr, &p->req);
-      return modbus_request_free(&p->req);
+  for (int i = 1; m->slave.units && i < MODBUS_UNIT_MAX; i++) {
+    modbus_unit_t *unit = m->slave.units[i];
+    if (unit) {
+      slave_run(m, p, i, &unit->hooks, unit->model);
     }
+  }
+
+  m->flag &= ~MODBUS_FLAG_MUTE;
+}
+
+static void slave_forward(modbus_t *m, modbus_package_t *p) {
+#if defined(MODBUS_STATS)
+  m->stats.forwarded++;
+  // the reply comes later through the gateway, not timed as a local one
+  m->decoded_at = 0;
+#endif
+
+  if (m->slave.gateway) {
+    modbus_gateway_forward(m, p);
+  } else if (m->hooks.forward) {
+    ((modbus_hook_t)m->hooks.forward)(p->addr, &p->req);
+  }
 
+  modbus_request_free(&p->req);
+}
+
+static void hook_run(modbus_t *m, modbus_package_t *p) {
+  if (m->role == MODBUS_ROLE_SLAVE) {
     if (MODBUS_BROADCAST_ADDRESS == p->addr) {
-      forward_func(p->addr, &p->req);
-      return modbus_request_free(&p->req);
+      slave_broadcast(m, p);
+      return slave_forward(m, p);
     }
 
-    hook_func = hooks[p->req.opcode & MODBUS_OPCODE_FUNC_MASK];
-    hook_arg = &p->req;
-    free_func = (modbus_free_t)modbus_request_free;
+    modbus_hooks_t *hooks = &m->hooks;
+    modbus_model_t *model = m->slave.model;
+
+    if (m->slave.units) {
+      modbus_unit_t *unit = 0;
+      if (p->addr < MODBUS_UNIT_MAX) {
+        unit = m->slave.units[p->addr];
+      }
+
+      if (!unit) {
+        return slave_forward(m, p);
+      }
+
+      hooks = &unit->hooks;
+      model = unit->model;
+    } else if (m->slave.addr != p->addr) {
+      return slave_forward(m, p);
+    }
+
+    slave_run(m, p, p->addr, hooks, model);
+    return modbus_request_free(&p->req);
   }
 
   if (m->role == MODBUS_ROLE_MASTER) {
-    hook_func = hooks[p->rep.opcode & MODBUS_OPCODE_FUNC_MASK];
-    hook_arg = &p->rep;
-    free_func = (modbus_free_t)modbus_reply_free;
-  }
+#if defined(MODBUS_STATS)
+    if (MODBUS_OPCODE_IS_ERROR(p->rep.opcode)) {
+      m->stats.exceptions++;
+    }
 
-  if (hook_func) {
-    hook_func(p->addr, hook_arg);
-  }
+    if (p->sent) {
+      modbus_stats_record(m->stats.request, modbus_arch_micros() - p->sent);
+      m->sent_at = 0;
+    }
+#endif
 
-  if (!hook_func && m->role == MODBUS_ROLE_SLAVE) {
-    modbus_reply_t rep;
-    modbus_error_init(&rep, &p->req, 0x01);
-    modbus_reply_send(&rep, p->addr, m);
-    modbus_reply_free(&rep);
-  }
+    if (m->master.engine && modbus_master_reply(m, p)) {
+      return;
+    }
 
-  if (free_func) free_func(hook_arg);
+    modbus_hook_t hook_func = hook_find(&m->hooks, p->rep.opcode);
+    if (hook_func) {
+      hook_func(p->addr, &p->rep);
+    }
+
+    modbus_reply_free(&p->rep);
+  }
 }
 
 void modbus_init(modbus_t *m) {
   modbus_driver_t *driver = m->driver;
 
+  int blocks = m->pool.capacity;
+  if (blocks == 0) {
+    blocks = MODBUS_POOL_BLOCKS;
+  }
+  modbus_pool_init(&m->pool, blocks);
+
+#if defined(MODBUS_STATS)
+  modbus_stats_reset(m);
+  m->decoded_at = 0;
+  m->sent_at = 0;
+#endif
+
   driver->init(driver);
+
+  // socket drivers written before the receive ring never set one up and
+  // would silently receive nothing
+  if (m->parser == &modbus_parser_socket) {
+    modbus_driver_socket_t *drv = m->driver;
+    if (drv->inbuf.capacity == 0) {
+      modbus_buffer_init(&drv->inbuf, MODBUS_SOCKET_INBUF_SIZE);
+      m->flag |= MODBUS_FLAG_OWN_INBUF;
+    }
+  }
 }
 
 void modbus_kill(modbus_t *m) {
   modbus_driver_t *driver = m->driver;
   driver->kill(driver);
+
+  if ((m->flag & MODBUS_FLAG_OWN_INBUF) == MODBUS_FLAG_OWN_INBUF) {
+    modbus_driver_socket_t *drv = m->driver;
+    modbus_buffer_kill(&drv->inbuf);
+    m->flag &= ~MODBUS_FLAG_OWN_INBUF;
+  }
+
+  modbus_pool_kill(&m->pool);
 }
 
 void modbus_idle(modbus_t *m) {
@@ -67,22 +180,58 @@ void modbus_idle(modbus_t *m) {
 
   modbus_arch_memset(&package, 0, sizeof(package));
 
+  package.flag = m->flag;
+  package.pool = &m->pool;
   package.extra = m->extra;
-  if (!parser->decode(m->role, &package, driver)) return;
-  hook_run(m, &package);
+#if defined(MODBUS_STATS)
+  package.stats = &m->stats;
+  package.sent = m->sent_at;
+#endif
+#if defined(MODBUS_CAPTURE)
+  package.capture = m->capture;
+  package.channel = m->channel;
+#endif
+
+  // drain every complete frame already buffered by the driver
+  while (parser->decode(m->role, &package, driver)) {
+#if defined(MODBUS_STATS)
+    uint32_t start = modbus_arch_micros();
+    m->decoded_at = start;
+    hook_run(m, &package);
+
+    uint32_t spent = modbus_arch_micros() - start;
+    m->stats.hook_us += spent;
+    modbus_stats_record(m->stats.hook, spent);
+    package.sent = m->sent_at;
+#else
+    hook_run(m, &package);
+#endif
+    modbus_arch_memset(&package.req, 0, sizeof(modbus_request_t));
+    package.addr = 0;
+  }
+
+  if (m->role == MODBUS_ROLE_MASTER && m->master.engine) {
+    modbus_master_idle(m);
+  }
 }
 
 void modbus_request_init(modbus_request_t *req, uint8_t opcode) {
+  modbus_request_init_pool(req, opcode, 0);
+}
+
+void modbus_request_init_pool(modbus_request_t *req, uint8_t opcode,
+                              modbus_t *m) {
   modbus_arch_memset(req, 0, sizeof(modbus_request_t));
   req->opcode = opcode;
+  req->payload.pool = m ? &m->pool : 0;
 
   if (MODBUS_REQUEST_HAS_PAYLOAD(req->opcode)) {
-    req->payload.u8 = modbus_arch_malloc(MODBUS_PAYLOAD_BUFFER_SIZE);
+    modbus_payload_alloc(&req->payload);
     modbus_arch_memset(req->payload.u8, 0, MODBUS_PAYLOAD_BUFFER_SIZE);
   }
 }
 
-void modbus_request_send(modbus_request_t *req, uint8_t addr, modbus_t *m) {
+bool modbus_request_send(modbus_request_t *req, uint8_t addr, modbus_t *m) {
   modbus_package_t package;
   modbus_parser_t *parser = m->parser;
   void *driver = m->driver;
@@ -91,17 +240,22 @@ void modbus_request_send(modbus_request_t *req, uint8_t addr, modbus_t *m) {
   modbus_arch_memcpy(&package.req, req, sizeof(modbus_request_t));
 
   package.addr = addr;
+  package.pool = &m->pool;
   package.extra = m->extra;
-
-  parser->encode(m->role, &package, driver);
+#if defined(MODBUS_STATS)
+  package.stats = &m->stats;
+  m->sent_at = modbus_arch_micros();
+#endif
+#if defined(MODBUS_CAPTURE)
+  package.capture = m->capture;
+  package.channel = m->channel;
+#endif
+
+  return parser->encode(m->role, &package, driver);
 }
 
 void modbus_request_free(modbus_request_t *req) {
-  if (req->payload.u8) {
-    modbus_arch_free(req->payload.u8);
-    req->payload.u8 = 0;
-    req->payload.length = 0;
-  }
+  modbus_payload_free(&req->payload);
 }
 
 void modbus_reply_init(modbus_reply_t *rep, modbus_request_t *req) {
@@ -109,9 +263,12 @@ void modbus_reply_init(modbus_reply_t *rep, modbus_request_t *req) {
   rep->opcode = req->opcode;
   rep->address = req->address;
   rep->length = req->length;
+  rep->write_address = req->write_address;
+  rep->write_length = req->write_length;
+  rep->payload.pool = req->payload.pool;
 
   if (MODBUS_REPLY_HAS_PAYLOAD(rep->opcode)) {
-    rep->payload.u8 = modbus_arch_malloc(MODBUS_PAYLOAD_BUFFER_SIZE);
+    modbus_payload_alloc(&rep->payload);
     modbus_arch_memset(rep->payload.u8, 0, MODBUS_PAYLOAD_BUFFER_SIZE);
 
     if (MODBUS_REPLY_PAYLOAD_IS_BIT(rep->opcode)) {
@@ -131,33 +288,60 @@ void modbus_reply_send(modbus_reply_t *rep, uint8_t addr, modbus_t *m) {
   modbus_parser_t *parser = m->parser;
   void *driver = m->driver;
 
+  if ((m->flag & MODBUS_FLAG_MUTE) == MODBUS_FLAG_MUTE) {
+    return;
+  }
+
   modbus_package_t package;
   modbus_arch_memset(&package, 0, sizeof(modbus_package_t));
   modbus_arch_memcpy(&package.rep, rep, sizeof(modbus_reply_t));
 
   package.addr = addr;
+  package.pool = &m->pool;
   package.extra = m->extra;
+#if defined(MODBUS_STATS)
+  package.stats = &m->stats;
+  if (MODBUS_OPCODE_IS_ERROR(rep->opcode)) {
+    m->stats.exceptions++;
+  }
+#endif
+#if defined(MODBUS_CAPTURE)
+  package.capture = m->capture;
+  package.channel = m->channel;
+#endif
 
   parser->encode(m->role, &package, driver);
+
+#if defined(MODBUS_STATS)
+  if (m->decoded_at) {
+    modbus_stats_record(m->stats.reply, modbus_arch_micros() - m->decoded_at);
+    m->decoded_at = 0;
+  }
+#endif
 }
 
 void modbus_reply_free(modbus_reply_t *rep) {
-  if (rep->payload.u8) {
-    modbus_arch_free(rep->payload.u8);
-    rep->payload.u8 = 0;
-    rep->payload.length = 0;
-  }
+  modbus_payload_free(&rep->payload);
 }
 
 void modbus_error_init(modbus_reply_t *rep, modbus_request_t *req,
                        uint8_t code) {
   modbus_reply_init(rep, req);
   if (rep->payload.u8 == 0) {
-    rep->payload.u8 = modbus_arch_malloc(MODBUS_PAYLOAD_BUFFER_SIZE);
+    modbus_payload_alloc(&rep->payload);
     modbus_arch_memset(rep->payload.u8, 0, MODBUS_PAYLOAD_BUFFER_SIZE);
   }
 
   rep->opcode |= MODBUS_OPCODE_ERROR_MASK;
   rep->payload.u8[0] = code;
   rep->payload.length = 1;
+}
+
+void *modbus_unit_context(modbus_t *m, uint8_t addr) {
+  if (!m->slave.units || addr >= MODBUS_UNIT_MAX) {
+    return 0;
+  }
+
+  modbus_unit_t *unit = m->slave.units[addr];
+  return unit ? unit->context : 0;
 }
\ No newline at end of file
@@ -2,15 +2,26 @@
 #define __MODBUS_MODBUS_H__
 
 #include "arch.h"
+#include "capture.h"
 #include "define.h"
+#include "file.h"
+#include "gateway.h"
+#include "master.h"
+#include "model.h"
 #include "parser.h"
+#include "planner.h"
+#include "pool.h"
+#include "stats.h"
 
 void modbus_init(modbus_t* m);
 void modbus_idle(modbus_t* m);
 void modbus_kill(modbus_t* m);
 
 void modbus_request_init(modbus_request_t* req, uint8_t opcode);
-void modbus_request_send(modbus_request_t* req, uint8_t addr, modbus_t* m);
+// as modbus_request_init with the payload taken from the pool of m
+void modbus_request_init_pool(modbus_request_t* req, uint8_t opcode,
+                              modbus_t* m);
+bool modbus_request_send(modbus_request_t* req, uint8_t addr, modbus_t* m);
 void modbus_request_free(modbus_request_t* req);
 
 void modbus_reply_init(modbus_reply_t* rep, modbus_request_t* req);
@@ -20,4 +31,7 @@ void modbus_reply_free(modbus_reply_t* rep);
 void modbus_error_init(modbus_reply_t* rep, modbus_request_t* req,
                        uint8_t code);
 
+// hooks of a unit get its own address, during a broadcast as well
+void* modbus_unit_context(modbus_t* m, uint8_t addr);
+
 #endif
\ No newline at end of file
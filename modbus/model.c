@@ -0,0 +1,269 @@
+#include "model.h"
+
+#include "arch.h"
+#include "modbus.h"
+
+static modbus_table_t* model_table(modbus_model_t* model, uint8_t opcode) {
+  switch (opcode) {
+    case MODBUS_OPCODE_READ_COILS:
+    case MODBUS_OPCODE_WRITE_COIL:
+    case MODBUS_OPCODE_WRITE_COILS:
+      return &model->coils;
+    case MODBUS_OPCODE_DISCRETE_INPUTS:
+      return &model->discrete_inputs;
+    case MODBUS_OPCODE_READ_HOLDING_REGISTERS:
+    case MODBUS_OPCODE_WRITE_REGISTER:
+    case MODBUS_OPCODE_WRITE_REGISTERS:
+    case MODBUS_OPCODE_MASK_WRITE_REGISTER:
+    case MODBUS_OPCODE_READ_WRITE_REGISTERS:
+      return &model->holding_registers;
+    case MODBUS_OPCODE_READ_INPUT_REGISTERS:
+      return &model->input_registers;
+  }
+  return 0;
+}
+
+static bool model_contains(modbus_table_t* t, uint16_t address, int length) {
+  return address >= t->address &&
+         (uint32_t)address + length <= (uint32_t)t->address + t->length;
+}
+
+static uint8_t model_bits_read(modbus_table_t* t, modbus_reply_t* rep,
+                               modbus_request_t* req) {
+  if (req->length == 0 || req->length > MODBUS_MODEL_MAX_BITS) {
+    return MODBUS_EXCEPTION_ILLEGAL_VALUE;
+  }
+
+  if (!model_contains(t, req->address, req->length)) {
+    return MODBUS_EXCEPTION_ILLEGAL_ADDRESS;
+  }
+
+  modbus_reply_init(rep, req);
+
+  int offset = req->address - t->address;
+  int shift = offset & 7;
+  uint8_t* src = &t->bits[offset >> 3];
+  uint8_t* dst = rep->payload.u8;
+  int last = (t->length - 1) >> 3;
+
+  for (int i = 0; i < rep->payload.length; i++) {
+    uint8_t v = src[i] >> shift;
+    if (shift && (src - t->bits) + i + 1 <= last) {
+      v |= src[i + 1] << (8 - shift);
+    }
+    dst[i] = v;
+  }
+
+  // unused high bits of the last byte must be zero
+  if (req->length & 7) {
+    dst[rep->payload.length - 1] &= (1 << (req->length & 7)) - 1;
+  }
+
+  return 0;
+}
+
+static uint8_t model_regs_read(modbus_table_t* t, modbus_reply_t* rep,
+                               modbus_request_t* req) {
+  if (req->length == 0 || req->length > MODBUS_MODEL_MAX_REGISTERS) {
+    return MODBUS_EXCEPTION_ILLEGAL_VALUE;
+  }
+
+  if (!model_contains(t, req->address, req->length)) {
+    return MODBUS_EXCEPTION_ILLEGAL_ADDRESS;
+  }
+
+  // the reply is encoded straight from the table
+  modbus_arch_memset(rep, 0, sizeof(modbus_reply_t));
+  rep->opcode = req->opcode;
+  rep->address = req->address;
+  rep->length = req->length;
+  rep->payload.flag = MODBUS_PAYLOAD_VIEW;
+  rep->payload.length = req->length * 2;
+  rep->payload.u16 = &t->regs[req->address - t->address];
+  return 0;
+}
+
+static uint8_t model_write_coil(modbus_table_t* t, modbus_reply_t* rep,
+                                modbus_request_t* req) {
+  if (req->value != MODBUS_WRITE_COIL_TRUE &&
+      req->value != MODBUS_WRITE_COIL_FALSE) {
+    return MODBUS_EXCEPTION_ILLEGAL_VALUE;
+  }
+
+  if (!model_contains(t, req->address, 1)) {
+    return MODBUS_EXCEPTION_ILLEGAL_ADDRESS;
+  }
+
+  modbus_model_set_bit(t, req->address, req->value == MODBUS_WRITE_COIL_TRUE);
+  modbus_reply_init(rep, req);
+  return 0;
+}
+
+static uint8_t model_write_coils(modbus_table_t* t, modbus_reply_t* rep,
+                                 modbus_request_t* req) {
+  if (req->length == 0 || req->length > MODBUS_MODEL_MAX_WRITE_BITS ||
+      req->payload.length != (req->length + 7) / 8) {
+    return MODBUS_EXCEPTION_ILLEGAL_VALUE;
+  }
+
+  if (!model_contains(t, req->address, req->length)) {
+    return MODBUS_EXCEPTION_ILLEGAL_ADDRESS;
+  }
+
+  for (int i = 0; i < req->length; i++) {
+    bool v = (req->payload.u8[i >> 3] >> (i & 7)) & 1;
+    modbus_model_set_bit(t, req->address + i, v);
+  }
+
+  modbus_reply_init(rep, req);
+  return 0;
+}
+
+static uint8_t model_write_register(modbus_table_t* t, modbus_reply_t* rep,
+                                    modbus_request_t* req) {
+  if (!model_contains(t, req->address, 1)) {
+    return MODBUS_EXCEPTION_ILLEGAL_ADDRESS;
+  }
+
+  t->regs[req->address - t->address] = req->value;
+  modbus_reply_init(rep, req);
+  return 0;
+}
+
+static uint8_t model_write_registers(modbus_table_t* t, modbus_reply_t* rep,
+                                     modbus_request_t* req) {
+  if (req->length == 0 || req->length > MODBUS_MODEL_MAX_WRITE_REGISTERS ||
+      req->payload.length != req->length * 2) {
+    return MODBUS_EXCEPTION_ILLEGAL_VALUE;
+  }
+
+  if (!model_contains(t, req->address, req->length)) {
+    return MODBUS_EXCEPTION_ILLEGAL_ADDRESS;
+  }
+
+  modbus_arch_memcpy(&t->regs[req->address - t->address], req->payload.u16,
+                     req->length * 2);
+  modbus_reply_init(rep, req);
+  return 0;
+}
+
+static uint8_t model_mask_write_register(modbus_table_t* t,
+                                         modbus_reply_t* rep,
+                                         modbus_request_t* req) {
+  if (!model_contains(t, req->address, 1)) {
+    return MODBUS_EXCEPTION_ILLEGAL_ADDRESS;
+  }
+
+  // bits set in the and mask are kept, the others come from the or mask
+  uint16_t* reg = &t->regs[req->address - t->address];
+  *reg = (*reg & req->and_mask) | (req->or_mask & ~req->and_mask);
+  modbus_reply_init(rep, req);
+  return 0;
+}
+
+static uint8_t model_read_write_registers(modbus_table_t* t,
+                                          modbus_reply_t* rep,
+                                          modbus_request_t* req) {
+  if (req->length == 0 || req->length > MODBUS_MODEL_MAX_REGISTERS ||
+      req->write_length == 0 ||
+      req->write_length > MODBUS_MODEL_MAX_READ_WRITE_REGISTERS ||
+      req->payload.length != req->write_length * 2) {
+    return MODBUS_EXCEPTION_ILLEGAL_VALUE;
+  }
+
+  if (!model_contains(t, req->write_address, req->write_length) ||
+      !model_contains(t, req->address, req->length)) {
+    return MODBUS_EXCEPTION_ILLEGAL_ADDRESS;
+  }
+
+  // the write is done before the read so overlapping ranges read it back
+  modbus_arch_memcpy(&t->regs[req->write_address - t->address],
+                     req->payload.u16, req->write_length * 2);
+  return model_regs_read(t, rep, req);
+}
+
+bool modbus_model_get_bit(modbus_table_t* t, uint16_t address) {
+  int offset = address - t->address;
+  return (t->bits[offset >> 3] >> (offset & 7)) & 1;
+}
+
+void modbus_model_set_bit(modbus_table_t* t, uint16_t address, bool v) {
+  int offset = address - t->address;
+  if (v) {
+    t->bits[offset >> 3] |= 1 << (offset & 7);
+  } else {
+    t->bits[offset >> 3] &= ~(1 << (offset & 7));
+  }
+}
+
+bool modbus_model_serve(modbus_t* m, modbus_model_t* model,
+                        modbus_package_t* p) {
+  modbus_request_t* req = &p->req;
+  modbus_table_t* t = model_table(model, req->opcode);
+  if (!t || t->length == 0) {
+    return false;
+  }
+
+  modbus_reply_t rep;
+  uint8_t code = 0;
+  bool changed = false;
+
+  switch (req->opcode) {
+    case MODBUS_OPCODE_READ_COILS:
+    case MODBUS_OPCODE_DISCRETE_INPUTS:
+      code = model_bits_read(t, &rep, req);
+      break;
+    case MODBUS_OPCODE_READ_HOLDING_REGISTERS:
+    case MODBUS_OPCODE_READ_INPUT_REGISTERS:
+      code = model_regs_read(t, &rep, req);
+      break;
+    case MODBUS_OPCODE_WRITE_COIL:
+      code = model_write_coil(t, &rep, req);
+      changed = true;
+      break;
+    case MODBUS_OPCODE_WRITE_REGISTER:
+      code = model_write_register(t, &rep, req);
+      changed = true;
+      break;
+    case MODBUS_OPCODE_WRITE_COILS:
+      code = model_write_coils(t, &rep, req);
+      changed = true;
+      break;
+    case MODBUS_OPCODE_WRITE_REGISTERS:
+      code = model_write_registers(t, &rep, req);
+      changed = true;
+      break;
+    case MODBUS_OPCODE_MASK_WRITE_REGISTER:
+      code = model_mask_write_register(t, &rep, req);
+      changed = true;
+      break;
+    case MODBUS_OPCODE_READ_WRITE_REGISTERS:
+      code = model_read_write_registers(t, &rep, req);
+      changed = true;
+      break;
+  }
+
+  if (code) {
+    modbus_error_init(&rep, req, code);
+  }
+
+  modbus_reply_send(&rep, p->addr, m);
+  modbus_reply_free(&rep);
+
+  if (!code && changed && model->changed) {
+    uint16_t address = req->address;
+    uint16_t length = req->length;
+    if (req->opcode == MODBUS_OPCODE_WRITE_COIL ||
+        req->opcode == MODBUS_OPCODE_WRITE_REGISTER ||
+        req->opcode == MODBUS_OPCODE_MASK_WRITE_REGISTER) {
+      length = 1;
+    }
+    if (MODBUS_REQUEST_HAS_WRITE(req->opcode)) {
+      address = req->write_address;
+      length = req->write_length;
+    }
+    model->changed(model->arg, req->opcode, address, length);
+  }
+
+  return true;
+}
\ No newline at end of file
@@ -0,0 +1,19 @@
+#ifndef __MODBUS_MODEL_H__
+#define __MODBUS_MODEL_H__
+
+#include "define.h"
+
+#define MODBUS_MODEL_MAX_REGISTERS (125)
+#define MODBUS_MODEL_MAX_WRITE_REGISTERS (123)
+#define MODBUS_MODEL_MAX_READ_WRITE_REGISTERS (121)
+#define MODBUS_MODEL_MAX_BITS (2000)
+#define MODBUS_MODEL_MAX_WRITE_BITS (1968)
+
+bool modbus_model_get_bit(modbus_table_t* t, uint16_t address);
+void modbus_model_set_bit(modbus_table_t* t, uint16_t address, bool v);
+
+// answers a request from the tables, false when the model lacks the opcode
+bool modbus_model_serve(modbus_t* m, modbus_model_t* model,
+                        modbus_package_t* p);
+
+#endif
\ No newline at end of file
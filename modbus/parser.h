@@ -7,4 +7,13 @@
 extern modbus_parser_t modbus_parser_rtu;
 extern modbus_parser_t modbus_parser_socket;
 
+// rtu inter-character and inter-frame silence in microseconds, fixed
+// above 19200 baud as the serial line specification asks
+uint32_t modbus_rtu_t15(uint32_t baud);
+uint32_t modbus_rtu_t35(uint32_t baud);
+
+// drops received bytes and any frame half decoded, so a reply arriving
+// after its request timed out cannot answer the next one
+void modbus_rtu_flush(modbus_driver_rtu_t* drv);
+
 #endif
\ No newline at end of file
@@ -1,4 +1,13 @@
+#include "capture.h"
+#include "crc.h"
+#include "file.h"
 #include "parser.h"
+#include "pool.h"
+#include "stats.h"
+
+#ifndef MODBUS_RTU_CRC_STEP
+#define MODBUS_RTU_CRC_STEP (16)
+#endif
 
 static int driver_reader(void *arg, uint8_t *buf, int max) {
   modbus_driver_rtu_t *drv = arg;
@@ -11,34 +20,25 @@ static int driver_writer(void *arg, uint8_t *buf, int len) {
   return drv->send(arg, buf, len);
 }
 
-static uint16_t parser_crc16(modbus_buffer_t *b, int len) {
-  static const uint16_t table[2] = {0x0000, 0xA001};
-  uint16_t crc = 0xFFFF;
-  uint8_t val;
-  char bit = 0;
-  unsigned int xor = 0;
-
-  while (len--) {
-    modbus_buffer_read_u8(b, &val);
-    crc ^= val;
-
-    for (bit = 0; bit < 8; bit++) {
-      xor = crc & 1;
-      crc >>= 1;
-      crc ^= table[xor];
+static bool parser_decode_request(modbus_request_t *req, modbus_buffer_t *b,
+                                  uint8_t flag) {
+  // file record frames are a byte count and sub-requests without address
+  if (!MODBUS_REQUEST_PAYLOAD_RAW(req->opcode)) {
+    if (!modbus_buffer_read_u16(b, &req->address, true) ||
+        !modbus_buffer_read_u16(b, &req->length, true)) {
+      return false;
     }
   }
 
-  return crc;
-}
-
-static bool parser_decode_request(modbus_request_t *req, modbus_buffer_t *b) {
-  if (!modbus_buffer_read_u16(b, &req->address, true)) {
-    return false;
+  if (MODBUS_REQUEST_HAS_MASK(req->opcode)) {
+    return modbus_buffer_read_u16(b, &req->or_mask, true);
   }
 
-  if (!modbus_buffer_read_u16(b, &req->length, true)) {
-    return false;
+  if (MODBUS_REQUEST_HAS_WRITE(req->opcode)) {
+    if (!modbus_buffer_read_u16(b, &req->write_address, true) ||
+        !modbus_buffer_read_u16(b, &req->write_length, true)) {
+      return false;
+    }
   }
 
   if (MODBUS_REQUEST_HAS_PAYLOAD(req->opcode)) {
@@ -46,8 +46,22 @@ static bool parser_decode_request(modbus_request_t *req, modbus_buffer_t *b) {
       return false;
     }
 
-    req->payload.u8 = modbus_arch_malloc(MODBUS_PAYLOAD_BUFFER_SIZE);
-    if (MODBUS_REQUEST_PAYLOAD_BIT(req->opcode)) {
+    if (modbus_buffer_length(b) < req->payload.length) {
+      return false;
+    }
+
+    if ((flag & MODBUS_FLAG_DECODE_VIEW) == MODBUS_FLAG_DECODE_VIEW) {
+      req->payload.u8 = modbus_buffer_peek(b, req->payload.length);
+      if (req->payload.u8) {
+        req->payload.flag |= MODBUS_PAYLOAD_VIEW;
+        modbus_buffer_skip(b, req->payload.length);
+        return true;
+      }
+    }
+
+    modbus_payload_alloc(&req->payload);
+    if (MODBUS_REQUEST_PAYLOAD_BIT(req->opcode) ||
+        MODBUS_REQUEST_PAYLOAD_RAW(req->opcode)) {
       int readed = modbus_buffer_read(b, req->payload.u8, req->payload.length);
       if (readed != req->payload.length) {
         return false;
@@ -56,11 +70,8 @@ static bool parser_decode_request(modbus_request_t *req, modbus_buffer_t *b) {
 
     if (MODBUS_REQUEST_PAYLOAD_U16(req->opcode)) {
       uint8_t length = req->payload.length / 2;
-      uint16_t *ptr = req->payload.u16;
-      for (uint8_t i = 0; i < length; i++) {
-        if (!modbus_buffer_read_u16(b, ptr + i, true)) {
-          return false;
-        }
+      if (!modbus_buffer_read_u16s(b, req->payload.u16, length, true)) {
+        return false;
       }
     }
   }
@@ -77,10 +88,15 @@ static bool parser_decode_reply(modbus_reply_t *rep, modbus_buffer_t *b) {
     if (!modbus_buffer_read_u16(b, &rep->length, true)) {
       return false;
     }
+
+    if (MODBUS_REQUEST_HAS_MASK(rep->opcode) &&
+        !modbus_buffer_read_u16(b, &rep->or_mask, true)) {
+      return false;
+    }
   }
 
   if (MODBUS_REPLY_HAS_PAYLOAD(rep->opcode)) {
-    rep->payload.u8 = modbus_arch_malloc(MODBUS_PAYLOAD_BUFFER_SIZE);
+    modbus_payload_alloc(&rep->payload);
 
     if (!MODBUS_OPCODE_IS_ERROR(rep->opcode)) {
       if (!modbus_buffer_read_u8(b, &rep->payload.length)) {
@@ -90,7 +106,8 @@ static bool parser_decode_reply(modbus_reply_t *rep, modbus_buffer_t *b) {
       rep->payload.length = 1;
     }
 
-    if (MODBUS_REPLY_PAYLOAD_IS_BIT(rep->opcode)) {
+    if (MODBUS_REPLY_PAYLOAD_IS_BIT(rep->opcode) ||
+        MODBUS_REPLY_PAYLOAD_IS_RAW(rep->opcode)) {
       int readed = modbus_buffer_read(b, rep->payload.u8, rep->payload.length);
       if (readed != rep->payload.length) {
         return false;
@@ -99,12 +116,8 @@ static bool parser_decode_reply(modbus_reply_t *rep, modbus_buffer_t *b) {
 
     if (MODBUS_REPLY_PAYLOAD_IS_U16(rep->opcode)) {
       uint8_t length = rep->payload.length / 2;
-      uint16_t *ptr = rep->payload.u16;
-
-      for (uint8_t i = 0; i < length; i++) {
-        if (!modbus_buffer_read_u16(b, ptr + i, true)) {
-          return false;
-        }
+      if (!modbus_buffer_read_u16s(b, rep->payload.u16, length, true)) {
+        return false;
       }
     }
   }
@@ -115,9 +128,8 @@ static bool parser_decode_reply(modbus_reply_t *rep, modbus_buffer_t *b) {
 static bool parser_decode(modbus_role_t role, modbus_package_t *p,
                           modbus_buffer_t *b) {
   uint16_t crc16;
-  modbus_buffer_t reader, crc_reader;
+  modbus_buffer_t reader;
   modbus_buffer_copy(&reader, b);
-  modbus_buffer_copy(&crc_reader, b);
 
   if (!modbus_buffer_read_u8(&reader, &p->addr)) {
     return false;
@@ -128,37 +140,226 @@ static bool parser_decode(modbus_role_t role, modbus_package_t *p,
   }
 
   if (!MODBUS_OPCODE_ALLOWED(p->req.opcode)) {
-    goto on_error;
+    goto on_partial;
   }
 
   if (role == MODBUS_ROLE_SLAVE) {
-    if (!parser_decode_request(&p->req, &reader)) {
-      return false;
+    p->req.payload.pool = p->pool;
+    if (!parser_decode_request(&p->req, &reader, p->flag)) {
+      goto on_partial;
     }
   }
 
   if (role == MODBUS_ROLE_MASTER) {
+    p->rep.payload.pool = p->pool;
     if (!parser_decode_reply(&p->rep, &reader)) {
-      return false;
+      goto on_partial;
     }
   }
 
+  // parser_resync already checked the crc over the predicted length
   if (!modbus_buffer_read_u16(&reader, &crc16, false)) {
-    return false;
+    goto on_partial;
   }
 
-  int len = 0;
-  len += modbus_buffer_length(&crc_reader);
-  len -= modbus_buffer_length(&reader);
+  modbus_buffer_copy(b, &reader);
+  return true;
+on_partial:
+  modbus_payload_free(&p->req.payload);
+  return false;
+}
+
+// walks the count bytes of file record sub-requests or sub-responses at
+// reader so noise is not taken for the start of a long frame; 1 when they
+// fill count exactly, 0 while bytes are missing and -1 otherwise
+static int parser_predict_file(uint8_t func, bool reply,
+                               modbus_buffer_t *reader, int count) {
+  bool read = func == MODBUS_OPCODE_READ_FILE_RECORD;
+  if (read && !reply && count % 7) return -1;
+
+  int pos = 0;
+  while (pos < count) {
+    uint8_t head[7];
+    int size = 7;
+
+    // read sub-responses are a length and the reference, every other one
+    // opens with the reference and a 6 byte file, record and length
+    if (read && reply) {
+      if (modbus_buffer_read(reader, head, 2) != 2) return 0;
+      if (head[0] < 3 || head[0] % 2 == 0 ||
+          head[1] != MODBUS_FILE_REFERENCE) {
+        return -1;
+      }
+      size = 1 + head[0];
+      modbus_buffer_skip(reader, size - 2);
+    } else {
+      if (modbus_buffer_read(reader, head, 7) != 7) return 0;
+      uint16_t length = head[5] << 8 | head[6];
+      if (head[0] != MODBUS_FILE_REFERENCE || length == 0) return -1;
+      if (!read) {
+        size += length * 2;
+        modbus_buffer_skip(reader, size - 7);
+      }
+    }
 
-  if (crc16 != parser_crc16(&crc_reader, len - 2)) {
-    goto on_error;
+    pos += size;
+  }
+
+  return pos == count ? 1 : -1;
+}
+
+// expected length of a frame starting at the head of b, 0 while too few
+// bytes arrived to tell and -1 when no valid frame can start here
+static int parser_predict(modbus_role_t role, modbus_buffer_t *b) {
+  modbus_buffer_t reader;
+  modbus_buffer_copy(&reader, b);
+
+  uint8_t addr, opcode, count;
+  uint16_t address, length, quantity;
+  if (!modbus_buffer_read_u8(&reader, &addr) ||
+      !modbus_buffer_read_u8(&reader, &opcode)) {
+    return 0;
+  }
+
+  if (addr > 247 || !MODBUS_OPCODE_ALLOWED(opcode)) {
+    return -1;
+  }
+
+  uint8_t func = MODBUS_OPCODE_FUNC(opcode);
+  if (role == MODBUS_ROLE_SLAVE) {
+    if (MODBUS_OPCODE_IS_ERROR(opcode)) return -1;
+    if (MODBUS_REQUEST_HAS_MASK(func)) return 10;
+    if (MODBUS_REQUEST_PAYLOAD_RAW(func)) {
+      if (!modbus_buffer_read_u8(&reader, &count)) {
+        return 0;
+      }
+
+      // at least one 7 byte sub-request and no more than a pdu holds
+      if (count < 7 || count > MODBUS_FILE_MAX_BYTES) return -1;
+
+      int valid = parser_predict_file(func, false, &reader, count);
+      if (valid <= 0) return valid;
+      return 5 + count;
+    }
+    if (!MODBUS_REQUEST_HAS_PAYLOAD(func)) return 8;
+
+    if (!modbus_buffer_read_u16(&reader, &address, true) ||
+        !modbus_buffer_read_u16(&reader, &length, true)) {
+      return 0;
+    }
+
+    // read/write registers puts the write range before the byte count
+    int header = 9;
+    quantity = length;
+    if (MODBUS_REQUEST_HAS_WRITE(func)) {
+      if (!modbus_buffer_read_u16(&reader, &address, true) ||
+          !modbus_buffer_read_u16(&reader, &quantity, true)) {
+        return 0;
+      }
+      header = 13;
+    }
+
+    if (!modbus_buffer_read_u8(&reader, &count)) {
+      return 0;
+    }
+
+    // the byte count is implied by the quantity
+    int expect = (quantity + 7) / 8;
+    if (MODBUS_REQUEST_PAYLOAD_U16(func)) expect = quantity * 2;
+    if (length == 0 || quantity == 0 || count != expect) return -1;
+
+    return header + count;
+  }
+
+  if (MODBUS_OPCODE_IS_ERROR(opcode)) return 5;
+  if (MODBUS_REQUEST_HAS_MASK(func)) return 10;
+  if (MODBUS_REPLY_HAS_ATTR(func)) return 8;
+  if (addr == MODBUS_BROADCAST_ADDRESS) return -1;
+
+  if (!modbus_buffer_read_u8(&reader, &count)) {
+    return 0;
+  }
+
+  if (count == 0 || (MODBUS_REPLY_PAYLOAD_IS_U16(func) && count % 2)) {
+    return -1;
+  }
+
+  if (MODBUS_REPLY_PAYLOAD_IS_RAW(func)) {
+    int valid = parser_predict_file(func, true, &reader, count);
+    if (valid <= 0) return valid;
+  }
+
+  return 5 + count;
+}
+
+static void parser_reset(modbus_decoder_t *d) {
+  d->expect = 0;
+  d->scanned = 0;
+  d->crc = MODBUS_CRC16_INIT;
+}
+
+// 1 when the predicted frame heads b with a valid crc, 0 while it is still
+// arriving and -1 otherwise; the crc grows by the bytes new since last call,
+// in steps of MODBUS_RTU_CRC_STEP so single byte arrivals stay cheap
+static int parser_verify(modbus_decoder_t *d, modbus_buffer_t *b) {
+  int avail = modbus_buffer_length(b);
+  int body = d->expect - 2;
+  int upto = avail < body ? avail : body;
+
+  if (upto - d->scanned >= MODBUS_RTU_CRC_STEP ||
+      (upto == body && upto > d->scanned)) {
+    modbus_buffer_t reader;
+    modbus_buffer_copy(&reader, b);
+    modbus_buffer_skip(&reader, d->scanned);
+    d->crc = modbus_crc16_update(d->crc, &reader, upto - d->scanned);
+    d->scanned = upto;
+  }
+
+  if (avail < d->expect) {
+    return 0;
+  }
+
+  uint16_t crc16;
+  modbus_buffer_t reader;
+  modbus_buffer_copy(&reader, b);
+  modbus_buffer_skip(&reader, body);
+  modbus_buffer_read_u16(&reader, &crc16, false);
+
+  return crc16 == d->crc ? 1 : -1;
+}
+
+// drops bytes until a frame with a valid crc heads b, each byte is looked
+// at as a candidate start once and rejected by its header in most cases
+static bool parser_resync(modbus_role_t role, modbus_package_t *p,
+                          modbus_decoder_t *d, modbus_buffer_t *b) {
+  // p only feeds the counters, which compile away without MODBUS_STATS
+  (void)p;
+
+  while (!modbus_buffer_is_empty(b)) {
+    if (d->expect == 0) {
+      int len = parser_predict(role, b);
+      if (len == 0) return false;
+
+      if (len < 0) {
+        MODBUS_STATS_ADD(p->stats, dropped, 1);
+        modbus_buffer_skip(b, 1);
+        continue;
+      }
+
+      parser_reset(d);
+      d->expect = len;
+    }
+
+    int verified = parser_verify(d, b);
+    if (verified > 0) return true;
+    if (verified == 0) return false;
+
+    MODBUS_STATS_ADD(p->stats, crc_errors, 1);
+    MODBUS_STATS_ADD(p->stats, dropped, 1);
+    parser_reset(d);
+    modbus_buffer_skip(b, 1);
   }
 
-  modbus_buffer_copy(b, &reader);
-  return true;
-on_error:
-  modbus_buffer_read(b, (uint8_t *)&crc16, 1);
   return false;
 }
 
@@ -171,6 +372,11 @@ static bool parser_encode_reply(modbus_reply_t *rep, modbus_buffer_t *b) {
     if (!modbus_buffer_write_u16(b, &rep->length, true)) {
       return false;
     }
+
+    if (MODBUS_REQUEST_HAS_MASK(rep->opcode) &&
+        !modbus_buffer_write_u16(b, &rep->or_mask, true)) {
+      return false;
+    }
   }
 
   if (MODBUS_REPLY_HAS_PAYLOAD(rep->opcode)) {
@@ -180,7 +386,8 @@ static bool parser_encode_reply(modbus_reply_t *rep, modbus_buffer_t *b) {
       }
     }
 
-    if (MODBUS_REPLY_PAYLOAD_IS_BIT(rep->opcode)) {
+    if (MODBUS_REPLY_PAYLOAD_IS_BIT(rep->opcode) ||
+        MODBUS_REPLY_PAYLOAD_IS_RAW(rep->opcode)) {
       int writed = modbus_buffer_write(b, rep->payload.u8, rep->payload.length);
       if (writed != rep->payload.length) {
         return false;
@@ -189,11 +396,8 @@ static bool parser_encode_reply(modbus_reply_t *rep, modbus_buffer_t *b) {
 
     if (MODBUS_REPLY_PAYLOAD_IS_U16(rep->opcode)) {
       uint8_t length = rep->payload.length / 2;
-      uint16_t *ptr = rep->payload.u16;
-      for (uint8_t i = 0; i < length; i++) {
-        if (!modbus_buffer_write_u16(b, ptr + i, true)) {
-          return false;
-        }
+      if (!modbus_buffer_write_u16s(b, rep->payload.u16, length, true)) {
+        return false;
       }
     }
   }
@@ -202,12 +406,23 @@ static bool parser_encode_reply(modbus_reply_t *rep, modbus_buffer_t *b) {
 }
 
 static bool parser_encode_request(modbus_request_t *req, modbus_buffer_t *b) {
-  if (!modbus_buffer_write_u16(b, &req->address, true)) {
-    return false;
+  // file record frames are a byte count and sub-requests without address
+  if (!MODBUS_REQUEST_PAYLOAD_RAW(req->opcode)) {
+    if (!modbus_buffer_write_u16(b, &req->address, true) ||
+        !modbus_buffer_write_u16(b, &req->length, true)) {
+      return false;
+    }
   }
 
-  if (!modbus_buffer_write_u16(b, &req->length, true)) {
-    return false;
+  if (MODBUS_REQUEST_HAS_MASK(req->opcode)) {
+    return modbus_buffer_write_u16(b, &req->or_mask, true);
+  }
+
+  if (MODBUS_REQUEST_HAS_WRITE(req->opcode)) {
+    if (!modbus_buffer_write_u16(b, &req->write_address, true) ||
+        !modbus_buffer_write_u16(b, &req->write_length, true)) {
+      return false;
+    }
   }
 
   if (MODBUS_REQUEST_HAS_PAYLOAD(req->opcode)) {
@@ -215,7 +430,8 @@ static bool parser_encode_request(modbus_request_t *req, modbus_buffer_t *b) {
       return false;
     }
 
-    if (MODBUS_REQUEST_PAYLOAD_BIT(req->opcode)) {
+    if (MODBUS_REQUEST_PAYLOAD_BIT(req->opcode) ||
+        MODBUS_REQUEST_PAYLOAD_RAW(req->opcode)) {
       int writed = modbus_buffer_write(b, req->payload.u8, req->payload.length);
       if (writed != req->payload.length) {
         return false;
@@ -224,12 +440,8 @@ static bool parser_encode_request(modbus_request_t *req, modbus_buffer_t *b) {
 
     if (MODBUS_REQUEST_PAYLOAD_U16(req->opcode)) {
       uint8_t length = req->payload.length / 2;
-      uint16_t *ptr = req->payload.u16;
-
-      for (uint8_t i = 0; i < length; i++) {
-        if (!modbus_buffer_write_u16(b, ptr + i, true)) {
-          return false;
-        }
+      if (!modbus_buffer_write_u16s(b, req->payload.u16, length, true)) {
+        return false;
       }
     }
   }
@@ -242,7 +454,6 @@ static bool parser_encode(modbus_role_t role, modbus_package_t *p,
   modbus_buffer_t writer;
   modbus_buffer_t crc_reader;
   modbus_buffer_copy(&writer, b);
-  modbus_buffer_copy(&crc_reader, b);
 
   if (!modbus_buffer_write_u8(&writer, &p->addr)) {
     return false;
@@ -264,23 +475,60 @@ static bool parser_encode(modbus_role_t role, modbus_package_t *p,
     }
   }
 
-  crc_reader.readpos = b->writpos;
-  crc_reader.writpos = writer.writpos;
-  crc_reader.flag = 0;
-  if (crc_reader.readpos == crc_reader.writpos) {
-    crc_reader.flag = MODBUS_BUFFER_FULL;
-  }
+  modbus_buffer_copy(&crc_reader, &writer);
+  modbus_buffer_skip(&crc_reader, modbus_buffer_length(b));
 
   int len = 0;
   uint16_t crc16;
   len = modbus_buffer_length(&crc_reader);
-  crc16 = parser_crc16(&crc_reader, len);
+  crc16 = modbus_crc16_buffer(&crc_reader, len);
   modbus_buffer_write_u16(&writer, &crc16, false);
 
   modbus_buffer_copy(b, &writer);
   return true;
 }
 
+uint32_t modbus_rtu_t15(uint32_t baud) {
+  if (baud > 19200) return 750;
+  return (15 * 11 * 100000 + baud - 1) / baud;
+}
+
+uint32_t modbus_rtu_t35(uint32_t baud) {
+  if (baud > 19200) return 1750;
+  return (35 * 11 * 100000 + baud - 1) / baud;
+}
+
+static bool parser_timed(modbus_driver_rtu_t *drv) {
+  return drv->silence && drv->baud;
+}
+
+#if defined(MODBUS_CAPTURE)
+// records the bytes dropped between mark and b, then moves mark up to b;
+// b only shrinks while a decode runs
+static void parser_capture_rejected(modbus_package_t *p, modbus_buffer_t *mark,
+                                    modbus_buffer_t *b) {
+  int len = modbus_buffer_length(mark) - modbus_buffer_length(b);
+  if (p->capture && len > 0) {
+    modbus_buffer_limit(mark, len);
+    modbus_capture_frame(p->capture,
+                         MODBUS_CAPTURE_RTU | MODBUS_CAPTURE_REJECT,
+                         p->channel, mark);
+  }
+
+  modbus_buffer_copy(mark, b);
+}
+#endif
+
+void modbus_rtu_flush(modbus_driver_rtu_t *drv) {
+  modbus_buffer_t *inbuf = &drv->inbuf;
+
+  // bytes the driver already holds are stale as well
+  modbus_buffer_skip(inbuf, modbus_buffer_length(inbuf));
+  modbus_buffer_writer(inbuf, driver_reader, drv);
+  modbus_buffer_skip(inbuf, modbus_buffer_length(inbuf));
+  parser_reset(&drv->decoder);
+}
+
 bool modbus_parser_rtu_decode(modbus_role_t role, modbus_package_t *p,
                               void *driver) {
   modbus_driver_rtu_t *drv = driver;
@@ -292,7 +540,58 @@ bool modbus_parser_rtu_decode(modbus_role_t role, modbus_package_t *p,
 
   if (modbus_buffer_is_empty(inbuf)) return false;
 
-  return parser_decode(role, p, inbuf);
+  // the frame is still arriving until the line stays silent for t3.5
+  bool timed = parser_timed(drv);
+  if (timed && drv->silence(driver) < modbus_rtu_t35(drv->baud)) {
+    return false;
+  }
+
+  modbus_decoder_t *d = &drv->decoder;
+#if defined(MODBUS_CAPTURE)
+  modbus_buffer_t rejected;
+  modbus_buffer_copy(&rejected, inbuf);
+#endif
+  while (parser_resync(role, p, d, inbuf)) {
+#if defined(MODBUS_CAPTURE)
+    parser_capture_rejected(p, &rejected, inbuf);
+    modbus_buffer_t frame;
+    modbus_buffer_copy(&frame, inbuf);
+    modbus_buffer_limit(&frame, d->expect);
+#endif
+
+    parser_reset(d);
+    if (parser_decode(role, p, inbuf)) {
+      MODBUS_STATS_ADD(p->stats, decoded, 1);
+#if defined(MODBUS_CAPTURE)
+      if (p->capture) {
+        modbus_capture_frame(p->capture, MODBUS_CAPTURE_RTU, p->channel,
+                             &frame);
+      }
+#endif
+      // the view converts registers inside the input buffer, so only after
+      // the frame was captured as received
+      if (role == MODBUS_ROLE_SLAVE) {
+        modbus_payload_view(&p->req);
+      }
+      return true;
+    }
+
+    modbus_arch_memset(&p->req, 0, sizeof(modbus_request_t));
+    MODBUS_STATS_ADD(p->stats, dropped, 1);
+    modbus_buffer_skip(inbuf, 1);
+  }
+
+  // the silence delimits the frame, whatever failed to decode is dropped
+  if (timed) {
+    parser_reset(d);
+    MODBUS_STATS_ADD(p->stats, dropped, modbus_buffer_length(inbuf));
+    modbus_buffer_skip(inbuf, modbus_buffer_length(inbuf));
+  }
+
+#if defined(MODBUS_CAPTURE)
+  parser_capture_rejected(p, &rejected, inbuf);
+#endif
+  return false;
 }
 
 bool modbus_parser_rtu_encode(modbus_role_t role, modbus_package_t *p,
@@ -300,7 +599,31 @@ bool modbus_parser_rtu_encode(modbus_role_t role, modbus_package_t *p,
   modbus_driver_rtu_t *drv = driver;
   modbus_buffer_t *oubuf = &drv->oubuf;
 
-  return parser_encode(role, p, oubuf);
+#if defined(MODBUS_CAPTURE)
+  int queued = modbus_buffer_length(oubuf);
+#endif
+
+  if (!parser_encode(role, p, oubuf)) {
+    return false;
+  }
+
+  MODBUS_STATS_ADD(p->stats, encoded, 1);
+#if defined(MODBUS_CAPTURE)
+  if (p->capture) {
+    modbus_buffer_t frame;
+    modbus_buffer_copy(&frame, oubuf);
+    modbus_buffer_skip(&frame, queued);
+    modbus_capture_frame(p->capture, MODBUS_CAPTURE_RTU | MODBUS_CAPTURE_TX,
+                         p->channel, &frame);
+  }
+#endif
+
+  // framed drivers answer right away instead of on the next idle
+  if (parser_timed(drv)) {
+    modbus_buffer_reader(oubuf, driver_writer, driver);
+  }
+
+  return true;
 }
 
 modbus_parser_t modbus_parser_rtu = {
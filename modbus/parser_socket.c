@@ -1,12 +1,32 @@
+#include "capture.h"
 #include "parser.h"
+#include "pool.h"
+#include "stats.h"
 
-static bool parser_decode_request(modbus_request_t *req, modbus_buffer_t *b) {
-  if (!modbus_buffer_read_u16(b, &req->address, true)) {
-    return false;
+static int driver_reader(void *arg, uint8_t *buf, int max) {
+  modbus_driver_socket_t *drv = arg;
+  return drv->recv(arg, buf, max);
+}
+
+static bool parser_decode_request(modbus_request_t *req, modbus_buffer_t *b,
+                                  uint8_t flag) {
+  // file record frames are a byte count and sub-requests without address
+  if (!MODBUS_REQUEST_PAYLOAD_RAW(req->opcode)) {
+    if (!modbus_buffer_read_u16(b, &req->address, true) ||
+        !modbus_buffer_read_u16(b, &req->length, true)) {
+      return false;
+    }
   }
 
-  if (!modbus_buffer_read_u16(b, &req->length, true)) {
-    return false;
+  if (MODBUS_REQUEST_HAS_MASK(req->opcode)) {
+    return modbus_buffer_read_u16(b, &req->or_mask, true);
+  }
+
+  if (MODBUS_REQUEST_HAS_WRITE(req->opcode)) {
+    if (!modbus_buffer_read_u16(b, &req->write_address, true) ||
+        !modbus_buffer_read_u16(b, &req->write_length, true)) {
+      return false;
+    }
   }
 
   if (MODBUS_REQUEST_HAS_PAYLOAD(req->opcode)) {
@@ -14,8 +34,22 @@ static bool parser_decode_request(modbus_request_t *req, modbus_buffer_t *b) {
       return false;
     }
 
-    req->payload.u8 = modbus_arch_malloc(MODBUS_PAYLOAD_BUFFER_SIZE);
-    if (MODBUS_REQUEST_PAYLOAD_BIT(req->opcode)) {
+    if (modbus_buffer_length(b) < req->payload.length) {
+      return false;
+    }
+
+    if ((flag & MODBUS_FLAG_DECODE_VIEW) == MODBUS_FLAG_DECODE_VIEW) {
+      req->payload.u8 = modbus_buffer_peek(b, req->payload.length);
+      if (req->payload.u8) {
+        req->payload.flag |= MODBUS_PAYLOAD_VIEW;
+        modbus_buffer_skip(b, req->payload.length);
+        return true;
+      }
+    }
+
+    modbus_payload_alloc(&req->payload);
+    if (MODBUS_REQUEST_PAYLOAD_BIT(req->opcode) ||
+        MODBUS_REQUEST_PAYLOAD_RAW(req->opcode)) {
       int readed = modbus_buffer_read(b, req->payload.u8, req->payload.length);
       if (readed != req->payload.length) {
         return false;
@@ -24,11 +58,8 @@ static bool parser_decode_request(modbus_request_t *req, modbus_buffer_t *b) {
 
     if (MODBUS_REQUEST_PAYLOAD_U16(req->opcode)) {
       uint8_t length = req->payload.length / 2;
-      uint16_t *ptr = req->payload.u16;
-      for (uint8_t i = 0; i < length; i++) {
-        if (!modbus_buffer_read_u16(b, ptr + i, true)) {
-          return false;
-        }
+      if (!modbus_buffer_read_u16s(b, req->payload.u16, length, true)) {
+        return false;
       }
     }
   }
@@ -36,37 +67,189 @@ static bool parser_decode_request(modbus_request_t *req, modbus_buffer_t *b) {
   return true;
 }
 
+static bool parser_decode_reply(modbus_reply_t *rep, modbus_buffer_t *b) {
+  if (MODBUS_REPLY_HAS_ATTR(rep->opcode)) {
+    if (!modbus_buffer_read_u16(b, &rep->address, true)) {
+      return false;
+    }
+
+    if (!modbus_buffer_read_u16(b, &rep->length, true)) {
+      return false;
+    }
+
+    if (MODBUS_REQUEST_HAS_MASK(rep->opcode) &&
+        !modbus_buffer_read_u16(b, &rep->or_mask, true)) {
+      return false;
+    }
+  }
+
+  if (MODBUS_REPLY_HAS_PAYLOAD(rep->opcode)) {
+    modbus_payload_alloc(&rep->payload);
+
+    if (!MODBUS_OPCODE_IS_ERROR(rep->opcode)) {
+      if (!modbus_buffer_read_u8(b, &rep->payload.length)) {
+        return false;
+      }
+    } else {
+      rep->payload.length = 1;
+    }
+
+    if (MODBUS_REPLY_PAYLOAD_IS_BIT(rep->opcode) ||
+        MODBUS_REPLY_PAYLOAD_IS_RAW(rep->opcode)) {
+      int readed = modbus_buffer_read(b, rep->payload.u8, rep->payload.length);
+      if (readed != rep->payload.length) {
+        return false;
+      }
+    }
+
+    if (MODBUS_REPLY_PAYLOAD_IS_U16(rep->opcode)) {
+      uint8_t length = rep->payload.length / 2;
+      if (!modbus_buffer_read_u16s(b, rep->payload.u16, length, true)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+static void parser_inflight_release(modbus_mbap_t *mbap,
+                                    modbus_inflight_t *slot) {
+  slot->busy = false;
+  mbap->inflight_cnt--;
+}
+
+// frees the slots whose reply is overdue, it is not coming anymore
+static void parser_inflight_expire(modbus_mbap_t *mbap) {
+  uint32_t now = modbus_arch_millis();
+  uint32_t timeout = mbap->timeout;
+  if (timeout == 0) timeout = MODBUS_INFLIGHT_TIMEOUT;
+
+  for (int i = 0; i < mbap->inflight_len; i++) {
+    modbus_inflight_t *slot = &mbap->inflight[i];
+    if (slot->busy && (uint32_t)(now - slot->stamp) >= timeout) {
+      parser_inflight_release(mbap, slot);
+      mbap->expired++;
+    }
+  }
+}
+
+static modbus_inflight_t *parser_inflight_acquire(modbus_mbap_t *mbap,
+                                                  modbus_package_t *p) {
+  if (mbap->inflight_cnt >= mbap->inflight_len) {
+    parser_inflight_expire(mbap);
+  }
+
+  if (mbap->inflight_cnt >= mbap->inflight_len) {
+    return 0;
+  }
+
+  // skip ids whose slot still waits for an older reply
+  modbus_inflight_t *slot;
+  do {
+    mbap->transaction = mbap->next++;
+    slot = &mbap->inflight[mbap->transaction % mbap->inflight_len];
+  } while (slot->busy);
+
+  slot->busy = true;
+  slot->addr = p->addr;
+  slot->opcode = p->req.opcode;
+  slot->transaction = mbap->transaction;
+  slot->address = p->req.address;
+  slot->length = p->req.length;
+  slot->stamp = modbus_arch_millis();
+#if defined(MODBUS_STATS)
+  slot->sent = modbus_arch_micros();
+#endif
+  mbap->inflight_cnt++;
+  return slot;
+}
+
+static modbus_inflight_t *parser_inflight_find(modbus_mbap_t *mbap,
+                                               uint16_t transaction) {
+  if (mbap->inflight_len == 0) {
+    return 0;
+  }
+
+  modbus_inflight_t *slot =
+      &mbap->inflight[transaction % mbap->inflight_len];
+  if (!slot->busy || slot->transaction != transaction) {
+    return 0;
+  }
+
+  return slot;
+}
+
 static bool parser_decode(modbus_role_t role, modbus_package_t *p,
                           modbus_buffer_t *b) {
   modbus_mbap_t *mbap = p->extra;
+  modbus_buffer_t reader;
+  modbus_buffer_copy(&reader, b);
 
-  if (!modbus_buffer_read_u16(b, &mbap->transaction, true)) {
+  if (!modbus_buffer_read_u16(&reader, &mbap->transaction, true)) {
     return false;
   }
 
-  if (!modbus_buffer_read_u16(b, &mbap->protocol, true)) {
+  if (!modbus_buffer_read_u16(&reader, &mbap->protocol, true)) {
     return false;
   }
 
+  // parser_expect checked the length and that the frame arrived
   uint16_t length;
-  if (!modbus_buffer_read_u16(b, &length, true)) {
+  if (!modbus_buffer_read_u16(&reader, &length, true)) {
     return false;
   }
 
-  if (length != modbus_buffer_length(b)) {
-    return false;
-  }
+  // the frame is consumed whatever its content, its bytes stay in place
+  // until the next receive so views remain valid
+  modbus_buffer_limit(&reader, length);
+  modbus_buffer_skip(b, length + 6);
 
-  if (!modbus_buffer_read_u8(b, &p->addr)) {
+  if (!modbus_buffer_read_u8(&reader, &p->addr)) {
     return false;
   }
 
-  if (!modbus_buffer_read_u8(b, &p->req.opcode)) {
+  if (!modbus_buffer_read_u8(&reader, &p->req.opcode)) {
     return false;
   }
 
   if (role == MODBUS_ROLE_SLAVE) {
-    return parser_decode_request(&p->req, b);
+    p->req.payload.pool = p->pool;
+    if (!parser_decode_request(&p->req, &reader, p->flag) ||
+        !modbus_buffer_is_empty(&reader)) {
+      modbus_payload_free(&p->req.payload);
+      return false;
+    }
+
+    return true;
+  }
+
+  if (role == MODBUS_ROLE_MASTER) {
+    modbus_inflight_t *slot = parser_inflight_find(mbap, mbap->transaction);
+    if (!slot) {
+      return false;
+    }
+
+    parser_inflight_release(mbap, slot);
+    if (slot->addr != p->addr ||
+        slot->opcode != MODBUS_OPCODE_FUNC(p->rep.opcode)) {
+      return false;
+    }
+
+    // read replies do not echo their range, report the requested one
+    p->rep.address = slot->address;
+    p->rep.length = slot->length;
+#if defined(MODBUS_STATS)
+    p->sent = slot->sent;
+#endif
+    p->rep.payload.pool = p->pool;
+    if (!parser_decode_reply(&p->rep, &reader) ||
+        !modbus_buffer_is_empty(&reader)) {
+      modbus_payload_free(&p->rep.payload);
+      return false;
+    }
+
+    return true;
   }
 
   return false;
@@ -81,6 +264,11 @@ static bool parser_encode_reply(modbus_reply_t *rep, modbus_buffer_t *b) {
     if (!modbus_buffer_write_u16(b, &rep->length, true)) {
       return false;
     }
+
+    if (MODBUS_REQUEST_HAS_MASK(rep->opcode) &&
+        !modbus_buffer_write_u16(b, &rep->or_mask, true)) {
+      return false;
+    }
   }
 
   if (MODBUS_REPLY_HAS_PAYLOAD(rep->opcode)) {
@@ -90,7 +278,8 @@ static bool parser_encode_reply(modbus_reply_t *rep, modbus_buffer_t *b) {
       }
     }
 
-    if (MODBUS_REPLY_PAYLOAD_IS_BIT(rep->opcode)) {
+    if (MODBUS_REPLY_PAYLOAD_IS_BIT(rep->opcode) ||
+        MODBUS_REPLY_PAYLOAD_IS_RAW(rep->opcode)) {
       int writed = modbus_buffer_write(b, rep->payload.u8, rep->payload.length);
       if (writed != rep->payload.length) {
         return false;
@@ -99,11 +288,52 @@ static bool parser_encode_reply(modbus_reply_t *rep, modbus_buffer_t *b) {
 
     if (MODBUS_REPLY_PAYLOAD_IS_U16(rep->opcode)) {
       uint8_t length = rep->payload.length / 2;
-      uint16_t *ptr = rep->payload.u16;
-      for (uint8_t i = 0; i < length; i++) {
-        if (!modbus_buffer_write_u16(b, ptr + i, true)) {
-          return false;
-        }
+      if (!modbus_buffer_write_u16s(b, rep->payload.u16, length, true)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+static bool parser_encode_request(modbus_request_t *req, modbus_buffer_t *b) {
+  // file record frames are a byte count and sub-requests without address
+  if (!MODBUS_REQUEST_PAYLOAD_RAW(req->opcode)) {
+    if (!modbus_buffer_write_u16(b, &req->address, true) ||
+        !modbus_buffer_write_u16(b, &req->length, true)) {
+      return false;
+    }
+  }
+
+  if (MODBUS_REQUEST_HAS_MASK(req->opcode)) {
+    return modbus_buffer_write_u16(b, &req->or_mask, true);
+  }
+
+  if (MODBUS_REQUEST_HAS_WRITE(req->opcode)) {
+    if (!modbus_buffer_write_u16(b, &req->write_address, true) ||
+        !modbus_buffer_write_u16(b, &req->write_length, true)) {
+      return false;
+    }
+  }
+
+  if (MODBUS_REQUEST_HAS_PAYLOAD(req->opcode)) {
+    if (!modbus_buffer_write_u8(b, &req->payload.length)) {
+      return false;
+    }
+
+    if (MODBUS_REQUEST_PAYLOAD_BIT(req->opcode) ||
+        MODBUS_REQUEST_PAYLOAD_RAW(req->opcode)) {
+      int writed = modbus_buffer_write(b, req->payload.u8, req->payload.length);
+      if (writed != req->payload.length) {
+        return false;
+      }
+    }
+
+    if (MODBUS_REQUEST_PAYLOAD_U16(req->opcode)) {
+      uint8_t length = req->payload.length / 2;
+      if (!modbus_buffer_write_u16s(b, req->payload.u16, length, true)) {
+        return false;
       }
     }
   }
@@ -136,6 +366,16 @@ static bool parser_encode(modbus_role_t role, modbus_package_t *p,
     }
   }
 
+  if (role == MODBUS_ROLE_MASTER) {
+    if (!parser_encode_request(&p->req, b)) {
+      return false;
+    }
+
+    if (!parser_inflight_acquire(mbap, p)) {
+      return false;
+    }
+  }
+
   vskip = modbus_buffer_length(b) - 6;
   modbus_buffer_write_u16(&mbap_writer, &mbap->transaction, true);
   modbus_buffer_write_u16(&mbap_writer, &mbap->protocol, true);
@@ -143,16 +383,99 @@ static bool parser_encode(modbus_role_t role, modbus_package_t *p,
   return true;
 }
 
+// length of the frame heading b from its mbap header, 0 until the header
+// arrived; a length beyond a 260 byte adu, one that cannot fit or another
+// protocol than modbus means the stream lost its framing
+static int parser_expect(modbus_buffer_t *b) {
+  modbus_buffer_t reader;
+  modbus_buffer_copy(&reader, b);
+
+  uint16_t protocol, length;
+  modbus_buffer_skip(&reader, 2);
+  if (!modbus_buffer_read_u16(&reader, &protocol, true) ||
+      !modbus_buffer_read_u16(&reader, &length, true)) {
+    return 0;
+  }
+
+  if (protocol != 0 || length < 2 || length > 254 ||
+      length + 6 > b->capacity) {
+    modbus_buffer_skip(b, modbus_buffer_length(b));
+    return 0;
+  }
+
+  return length + 6;
+}
+
 bool modbus_parser_socket_decode(modbus_role_t role, modbus_package_t *p,
                                  void *driver) {
-  modbus_buffer_t stream;
   modbus_driver_socket_t *drv = driver;
+  modbus_buffer_t *inbuf = &drv->inbuf;
+
+  modbus_decoder_t *d = &drv->decoder;
+
+  modbus_buffer_writer(inbuf, driver_reader, driver);
+
+  // malformed frames are dropped and decoding moves on to the next one,
+  // it stops once only a partial frame is left
+  while (!modbus_buffer_is_empty(inbuf)) {
+    // the header is parsed once, later calls only wait for the length
+    if (d->expect == 0) {
+#if defined(MODBUS_CAPTURE)
+      modbus_buffer_t lost;
+      modbus_buffer_copy(&lost, inbuf);
+#endif
+      d->expect = parser_expect(inbuf);
+#if defined(MODBUS_CAPTURE)
+      // a stream that lost its framing is dropped whole
+      if (p->capture && modbus_buffer_is_empty(inbuf)) {
+        modbus_capture_frame(p->capture,
+                             MODBUS_CAPTURE_SOCKET | MODBUS_CAPTURE_REJECT,
+                             p->channel, &lost);
+      }
+#endif
+      if (d->expect == 0) break;
+    }
+
+    if (modbus_buffer_length(inbuf) < d->expect) {
+      break;
+    }
+
+#if defined(MODBUS_CAPTURE)
+    modbus_buffer_t frame;
+    modbus_buffer_copy(&frame, inbuf);
+    modbus_buffer_limit(&frame, d->expect);
+#endif
+
+    if (parser_decode(role, p, inbuf)) {
+      MODBUS_STATS_ADD(p->stats, decoded, 1);
+#if defined(MODBUS_CAPTURE)
+      if (p->capture) {
+        modbus_capture_frame(p->capture, MODBUS_CAPTURE_SOCKET, p->channel,
+                             &frame);
+      }
+#endif
+      // the view converts registers inside the input buffer, so only after
+      // the frame was captured as received
+      if (role == MODBUS_ROLE_SLAVE) {
+        modbus_payload_view(&p->req);
+      }
+      d->expect = 0;
+      return true;
+    }
 
-  int recv_len = drv->recv(driver, drv->cache, drv->cache_len);
-  if (recv_len == 0) return false;
+    MODBUS_STATS_ADD(p->stats, dropped, d->expect);
+#if defined(MODBUS_CAPTURE)
+    if (p->capture) {
+      modbus_capture_frame(p->capture,
+                           MODBUS_CAPTURE_SOCKET | MODBUS_CAPTURE_REJECT,
+                           p->channel, &frame);
+    }
+#endif
+    d->expect = 0;
+    modbus_arch_memset(&p->req, 0, sizeof(modbus_request_t));
+  }
 
-  modbus_buffer_init_reader(&stream, drv->cache, recv_len);
-  return parser_decode(role, p, &stream);
+  return false;
 }
 
 bool modbus_parser_socket_encode(modbus_role_t role, modbus_package_t *p,
@@ -165,16 +488,23 @@ bool modbus_parser_socket_encode(modbus_role_t role, modbus_package_t *p,
     return false;
   }
 
+#if defined(MODBUS_CAPTURE)
+  if (p->capture) {
+    modbus_capture_frame(p->capture, MODBUS_CAPTURE_SOCKET | MODBUS_CAPTURE_TX,
+                         p->channel, &stream);
+  }
+#endif
+
   int retry_max = 20;
   int retry_cnt = 0;
   int send_len = modbus_buffer_length(&stream);
   while (send_len) {
     if (retry_cnt == retry_max) {
-      return false;
+      goto on_error;
     }
 
-    int sent_len = drv->send(driver, drv->cache, send_len);
-    if (sent_len < 0) return false;
+    int sent_len = drv->send(driver, &drv->cache[stream.readpos], send_len);
+    if (sent_len < 0) goto on_error;
     if (sent_len == send_len) break;
 
     modbus_buffer_skip(&stream, sent_len);
@@ -182,7 +512,15 @@ bool modbus_parser_socket_encode(modbus_role_t role, modbus_package_t *p,
     retry_cnt++;
   }
 
+  MODBUS_STATS_ADD(p->stats, encoded, 1);
   return true;
+on_error:
+  if (role == MODBUS_ROLE_MASTER) {
+    modbus_mbap_t *mbap = p->extra;
+    parser_inflight_release(mbap,
+                            parser_inflight_find(mbap, mbap->transaction));
+  }
+  return false;
 }
 
 modbus_parser_t modbus_parser_socket = {
@@ -0,0 +1,186 @@
+#include "planner.h"
+
+#include "arch.h"
+#include "modbus.h"
+
+static bool planner_table(uint8_t table) {
+  return table == MODBUS_OPCODE_READ_COILS ||
+         table == MODBUS_OPCODE_DISCRETE_INPUTS ||
+         table == MODBUS_OPCODE_READ_HOLDING_REGISTERS ||
+         table == MODBUS_OPCODE_READ_INPUT_REGISTERS;
+}
+
+static int planner_limit(uint8_t table) {
+  if (table == MODBUS_OPCODE_READ_COILS ||
+      table == MODBUS_OPCODE_DISCRETE_INPUTS) {
+    return MODBUS_PLANNER_MAX_BITS;
+  }
+  return MODBUS_PLANNER_MAX_REGISTERS;
+}
+
+static bool planner_less(modbus_point_t *a, modbus_point_t *b) {
+  if (a->unit != b->unit) return a->unit < b->unit;
+  if (a->table != b->table) return a->table < b->table;
+  return a->address < b->address;
+}
+
+static void planner_swap(modbus_point_t *a, modbus_point_t *b) {
+  modbus_point_t t;
+  modbus_arch_memcpy(&t, a, sizeof(modbus_point_t));
+  modbus_arch_memcpy(a, b, sizeof(modbus_point_t));
+  modbus_arch_memcpy(b, &t, sizeof(modbus_point_t));
+}
+
+static void planner_sift(modbus_point_t *points, int root, int len) {
+  while (root * 2 + 1 < len) {
+    int child = root * 2 + 1;
+    if (child + 1 < len && planner_less(&points[child], &points[child + 1])) {
+      child++;
+    }
+
+    if (!planner_less(&points[root], &points[child])) return;
+
+    planner_swap(&points[root], &points[child]);
+    root = child;
+  }
+}
+
+static void planner_sort(modbus_point_t *points, int len) {
+  for (int i = len / 2 - 1; i >= 0; i--) {
+    planner_sift(points, i, len);
+  }
+
+  for (int end = len - 1; end > 0; end--) {
+    planner_swap(&points[0], &points[end]);
+    planner_sift(points, 0, end);
+  }
+}
+
+bool modbus_planner_plan(modbus_planner_t *pl) {
+  modbus_point_t *points = pl->points;
+  modbus_poll_t *poll = 0;
+  uint32_t end = 0;
+
+  pl->polls_cnt = 0;
+  planner_sort(points, pl->points_len);
+
+  // greedy: every request grows as far as the limit and the gap allow, a
+  // heuristic that is not optimal in general
+  for (int i = 0; i < pl->points_len; i++) {
+    modbus_point_t *point = &points[i];
+    uint32_t point_end = (uint32_t)point->address + point->count;
+
+    if (!planner_table(point->table) ||
+        point->unit == MODBUS_BROADCAST_ADDRESS) {
+      return false;
+    }
+
+    uint32_t limit = planner_limit(point->table);
+    if (point->count == 0 || point->count > limit) {
+      return false;
+    }
+
+    if (poll && poll->unit == point->unit && poll->opcode == point->table &&
+        point->address <= end + pl->gap &&
+        (point_end <= end || point_end - poll->address <= limit)) {
+      if (point_end > end) end = point_end;
+      poll->length = end - poll->address;
+      poll->points++;
+      continue;
+    }
+
+    if (pl->polls_cnt == pl->polls_len) {
+      return false;
+    }
+
+    poll = &pl->polls[pl->polls_cnt++];
+    poll->unit = point->unit;
+    poll->opcode = point->table;
+    poll->address = point->address;
+    poll->length = point->count;
+    poll->first = i;
+    poll->points = 1;
+    poll->planner = pl;
+    end = point_end;
+  }
+
+  return true;
+}
+
+int modbus_planner_saved(modbus_planner_t *pl) {
+  return pl->points_len - pl->polls_cnt;
+}
+
+bool modbus_planner_request(modbus_planner_t *pl, int index, modbus_t *m) {
+  modbus_poll_t *poll = &pl->polls[index];
+  modbus_request_t req;
+
+  modbus_request_init_pool(&req, poll->opcode, m);
+  req.address = poll->address;
+  req.length = poll->length;
+
+  bool sent = modbus_request_send(&req, poll->unit, m);
+  modbus_request_free(&req);
+  return sent;
+}
+
+void modbus_planner_scatter(modbus_planner_t *pl, int index,
+                            modbus_reply_t *rep) {
+  modbus_poll_t *poll = &pl->polls[index];
+  modbus_point_t *point = &pl->points[poll->first];
+
+  uint8_t error = 0;
+  if (!rep) {
+    error = MODBUS_POINT_TIMEOUT;
+  } else if (MODBUS_OPCODE_IS_ERROR(rep->opcode)) {
+    error = rep->payload.u8[0];
+  }
+
+  bool bits = planner_limit(poll->opcode) == MODBUS_PLANNER_MAX_BITS;
+  int need = bits ? (poll->length + 7) / 8 : poll->length * 2;
+  if (!error && rep->payload.length != need) {
+    error = MODBUS_POINT_MALFORMED;
+  }
+
+  for (int i = 0; i < poll->points; i++, point++) {
+    point->error = error;
+    if (error) continue;
+
+    int offset = point->address - poll->address;
+    if (bits) {
+      for (int k = 0; k < point->count; k++) {
+        int bit = offset + k;
+        point->bits[k] = (rep->payload.u8[bit >> 3] >> (bit & 7)) & 1;
+      }
+    } else {
+      modbus_arch_memcpy(point->regs, &rep->payload.u16[offset],
+                         point->count * 2);
+    }
+  }
+}
+
+static void planner_done(void *arg, uint8_t status, uint8_t addr,
+                         modbus_reply_t *rep) {
+  modbus_poll_t *poll = arg;
+  modbus_planner_t *pl = poll->planner;
+
+  modbus_planner_scatter(pl, poll - pl->polls, rep);
+}
+
+bool modbus_planner_submit(modbus_planner_t *pl, modbus_t *m) {
+  for (int i = 0; i < pl->polls_cnt; i++) {
+    modbus_poll_t *poll = &pl->polls[i];
+    modbus_request_t req;
+
+    modbus_request_init_pool(&req, poll->opcode, m);
+    req.address = poll->address;
+    req.length = poll->length;
+
+    if (!modbus_master_submit(m, &req, poll->unit, planner_done, poll)) {
+      modbus_request_free(&req);
+      return false;
+    }
+  }
+
+  return true;
+}
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef __MODBUS_PLANNER_H__
+#define __MODBUS_PLANNER_H__
+
+#include "define.h"
+
+#define MODBUS_PLANNER_MAX_REGISTERS (125)
+#define MODBUS_PLANNER_MAX_BITS (2000)
+
+// errors of a point besides the exception codes, malformed is a reply
+// whose size does not match the request
+#define MODBUS_POINT_TIMEOUT (0xFF)
+#define MODBUS_POINT_MALFORMED (0xFD)
+
+typedef struct {
+  uint8_t unit;
+  uint8_t table;
+  uint16_t address;
+  uint16_t count;
+  uint8_t error;
+  union {
+    uint8_t *bits;
+    uint16_t *regs;
+  };
+} modbus_point_t;
+
+typedef struct {
+  uint8_t unit;
+  uint8_t opcode;
+  uint16_t address;
+  uint16_t length;
+  uint16_t first;
+  uint16_t points;
+  void *planner;
+} modbus_poll_t;
+
+typedef struct {
+  // points are sorted in place, polls is caller provided room for the plan
+  modbus_point_t *points;
+  uint16_t points_len;
+  modbus_poll_t *polls;
+  uint16_t polls_len;
+  uint16_t polls_cnt;
+
+  // unused registers or coils a request may read to bridge two points
+  uint16_t gap;
+} modbus_planner_t;
+
+// false when a point is not in the FC01-FC04 tables, is addressed to the
+// broadcast unit, which never answers a read, has a count of 0 or over
+// the limit of one request, or polls has no room for the plan
+bool modbus_planner_plan(modbus_planner_t *pl);
+
+// frames spared compared to one request per point
+int modbus_planner_saved(modbus_planner_t *pl);
+
+bool modbus_planner_request(modbus_planner_t *pl, int index, modbus_t *m);
+void modbus_planner_scatter(modbus_planner_t *pl, int index,
+                            modbus_reply_t *rep);
+
+// queues every poll on the master engine, replies scatter on their own
+bool modbus_planner_submit(modbus_planner_t *pl, modbus_t *m);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,96 @@
+#include "pool.h"
+
+#include "arch.h"
+#include "swap.h"
+
+void modbus_pool_init(modbus_pool_t* pool, int blocks) {
+  modbus_arch_memset(pool, 0, sizeof(modbus_pool_t));
+  if (blocks <= 0) return;
+
+  pool->blocks = modbus_arch_malloc(blocks * MODBUS_PAYLOAD_BUFFER_SIZE);
+  if (!pool->blocks) return;
+
+  pool->capacity = blocks;
+
+  // free blocks are chained through their first bytes
+  for (int i = blocks - 1; i >= 0; i--) {
+    uint8_t* block = &pool->blocks[i * MODBUS_PAYLOAD_BUFFER_SIZE];
+    *(void**)block = pool->head;
+    pool->head = block;
+  }
+}
+
+void modbus_pool_kill(modbus_pool_t* pool) {
+  if (pool->blocks) {
+    modbus_arch_free(pool->blocks);
+  }
+  modbus_arch_memset(pool, 0, sizeof(modbus_pool_t));
+}
+
+uint8_t* modbus_pool_acquire(modbus_pool_t* pool) {
+  uint8_t* block = pool->head;
+  if (!block) return 0;
+
+  pool->head = *(void**)block;
+  pool->used++;
+  if (pool->used > pool->peak) {
+    pool->peak = pool->used;
+  }
+
+  return block;
+}
+
+void modbus_pool_release(modbus_pool_t* pool, uint8_t* block) {
+  *(void**)block = pool->head;
+  pool->head = block;
+  pool->used--;
+}
+
+uint8_t* modbus_payload_alloc(modbus_payload_t* payload) {
+  payload->flag &= ~(MODBUS_PAYLOAD_VIEW | MODBUS_PAYLOAD_POOL);
+
+  payload->u8 = 0;
+  if (payload->pool) {
+    payload->u8 = modbus_pool_acquire(payload->pool);
+  }
+
+  if (payload->u8) {
+    payload->flag |= MODBUS_PAYLOAD_POOL;
+  } else {
+    if (payload->pool) payload->pool->fallbacks++;
+    payload->u8 = modbus_arch_malloc(MODBUS_PAYLOAD_BUFFER_SIZE);
+  }
+
+  return payload->u8;
+}
+
+void modbus_payload_free(modbus_payload_t* payload) {
+  if (payload->u8) {
+    if ((payload->flag & MODBUS_PAYLOAD_POOL) == MODBUS_PAYLOAD_POOL) {
+      modbus_pool_release(payload->pool, payload->u8);
+    } else if ((payload->flag & MODBUS_PAYLOAD_VIEW) != MODBUS_PAYLOAD_VIEW) {
+      modbus_arch_free(payload->u8);
+    }
+  }
+
+  payload->u8 = 0;
+  payload->length = 0;
+  payload->flag = 0;
+}
+
+void modbus_payload_view(modbus_request_t* req) {
+  if ((req->payload.flag & MODBUS_PAYLOAD_VIEW) != MODBUS_PAYLOAD_VIEW) {
+    return;
+  }
+
+  if (!MODBUS_REQUEST_PAYLOAD_U16(req->opcode)) {
+    return;
+  }
+
+  // registers are big endian and may be unaligned in the input buffer,
+  // convert them in place and move down over the consumed byte count
+  uint8_t* raw = req->payload.u8;
+  uint16_t* ptr = (uint16_t*)(raw - ((uintptr_t)raw & 1));
+  modbus_swap16_load(ptr, raw, req->payload.length / 2);
+  req->payload.u16 = ptr;
+}
\ No newline at end of file
@@ -0,0 +1,21 @@
+#ifndef __MODBUS_POOL_H__
+#define __MODBUS_POOL_H__
+
+#include "define.h"
+
+void modbus_pool_init(modbus_pool_t* pool, int blocks);
+void modbus_pool_kill(modbus_pool_t* pool);
+
+uint8_t* modbus_pool_acquire(modbus_pool_t* pool);
+void modbus_pool_release(modbus_pool_t* pool, uint8_t* block);
+
+// payload buffers come from payload->pool and fall back to the heap, each
+// fallback is counted in pool->fallbacks so a pool too small shows up
+uint8_t* modbus_payload_alloc(modbus_payload_t* payload);
+void modbus_payload_free(modbus_payload_t* payload);
+
+// a request decoded as a view still points at big endian registers in the
+// driver input buffer, both parsers call this once the frame is accepted
+void modbus_payload_view(modbus_request_t* req);
+
+#endif
\ No newline at end of file
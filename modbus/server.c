@@ -0,0 +1,420 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "server.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arch.h"
+#include "modbus.h"
+
+#define SERVER_EVENTS (64)
+
+static uint64_t server_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void server_noop(void *this) {}
+
+static int server_recv(void *this, uint8_t *buf, int max) {
+  modbus_server_conn_t *conn = this;
+
+  int len = recv(conn->fd, buf, max, 0);
+  if (len == 0) conn->eof = true;
+  if (len < 0 && errno != EAGAIN && errno != EINTR) {
+    conn->closed = true;
+  }
+
+  if (len < 0) len = 0;
+  conn->recv_len = len;
+  return len;
+}
+
+static int server_write(void *this, uint8_t *buf, int len) {
+  modbus_server_conn_t *conn = this;
+
+  int sent = send(conn->fd, buf, len, MSG_NOSIGNAL);
+  if (sent < 0 && errno != EAGAIN && errno != EINTR) {
+    conn->closed = true;
+    return -1;
+  }
+
+  if (sent < 0) sent = 0;
+  return sent;
+}
+
+// decodes only while a whole reply still fits, writes while bytes wait;
+// after the peer shut down its side only the writes are left
+static void server_watch(modbus_server_t *s, modbus_server_conn_t *conn) {
+  uint32_t events = 0;
+  if (!conn->eof) {
+    events = EPOLLRDHUP;
+    if (modbus_buffer_free(&conn->outbuf) >= MODBUS_SERVER_CACHE_SIZE) {
+      events |= EPOLLIN;
+    }
+  }
+  if (!modbus_buffer_is_empty(&conn->outbuf)) {
+    events |= EPOLLOUT;
+  }
+
+  if (events == conn->events || conn->closed) return;
+
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = conn;
+  if (epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+    conn->closed = true;
+    return;
+  }
+
+  conn->events = events;
+}
+
+static int server_send(void *this, uint8_t *buf, int len) {
+  modbus_server_conn_t *conn = this;
+
+  // a reply queues behind unsent bytes so frames never interleave, and it
+  // is taken whole or not at all so the stream is never cut mid frame
+  int sent = 0;
+  if (modbus_buffer_is_empty(&conn->outbuf)) {
+    sent = server_write(conn, buf, len);
+    if (sent < 0 || sent == len) return sent;
+  }
+
+  if (modbus_buffer_free(&conn->outbuf) < len - sent) {
+    conn->closed = true;
+    return -1;
+  }
+
+  // gateway replies are sent outside of the poll loop, arm EPOLLOUT here
+  modbus_server_t *s = conn->server;
+  modbus_buffer_write(&conn->outbuf, buf + sent, len - sent);
+  s->deferred++;
+  server_watch(s, conn);
+  return len;
+}
+
+static void server_flush(modbus_server_conn_t *conn) {
+  while (!modbus_buffer_is_empty(&conn->outbuf)) {
+    if (modbus_buffer_reader(&conn->outbuf, server_write, conn) <= 0) {
+      return;
+    }
+  }
+}
+
+static bool server_decode(modbus_role_t role, modbus_package_t *p,
+                          void *driver) {
+  modbus_server_conn_t *conn = driver;
+
+  // the next reply has to fit outbuf whole, until it does requests wait in
+  // inbuf and the socket is not read
+  if (modbus_buffer_free(&conn->outbuf) < MODBUS_SERVER_CACHE_SIZE) {
+    return false;
+  }
+
+  if (!modbus_parser_socket.decode(role, p, driver)) {
+    return false;
+  }
+
+  modbus_server_t *s = conn->server;
+  s->requests++;
+  return true;
+}
+
+static void server_close(modbus_server_t *s, modbus_server_conn_t *conn) {
+  if (s->modbus.slave.gateway) {
+    modbus_gateway_drop(s->modbus.slave.gateway, conn);
+  }
+
+  epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, conn->fd, 0);
+  close(conn->fd);
+
+  conn->fd = -1;
+  conn->next = s->idle;
+  s->idle = conn;
+
+  s->connections--;
+  s->closed++;
+}
+
+static void server_accept(modbus_server_t *s) {
+  while (1) {
+    int fd = accept4(s->listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+
+    modbus_server_conn_t *conn = s->idle;
+    if (!conn) {
+      close(fd);
+      continue;
+    }
+
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (s->send_buffer > 0) {
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &s->send_buffer,
+                 sizeof(s->send_buffer));
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = conn;
+    conn->events = ev.events;
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      close(fd);
+      continue;
+    }
+
+    s->idle = conn->next;
+    modbus_arch_memset(&conn->mbap, 0, sizeof(modbus_mbap_t));
+    modbus_buffer_skip(&conn->driver.inbuf,
+                       modbus_buffer_length(&conn->driver.inbuf));
+    modbus_arch_memset(&conn->driver.decoder, 0, sizeof(modbus_decoder_t));
+    modbus_buffer_skip(&conn->outbuf, modbus_buffer_length(&conn->outbuf));
+    conn->fd = fd;
+    conn->eof = false;
+    conn->closed = false;
+    conn->next = 0;
+
+    s->connections++;
+    s->accepted++;
+  }
+}
+
+static void server_serve(modbus_server_t *s, modbus_server_conn_t *conn) {
+  modbus_t *m = &s->modbus;
+
+  m->driver = conn;
+  m->extra = &conn->mbap;
+#if defined(MODBUS_CAPTURE)
+  m->channel = conn - s->conns;
+#endif
+
+  do {
+    conn->recv_len = 0;
+    modbus_idle(m);
+  } while (conn->recv_len > 0 && !conn->closed && !conn->eof);
+
+  m->driver = &s->listener;
+  m->extra = 0;
+}
+
+// a listening socket on every address of family, -1 on failure
+static int server_listen(int family, uint16_t port) {
+  int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  IPPROTO_TCP);
+  if (fd < 0) return -1;
+
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+  struct sockaddr_in6 addr6;
+  struct sockaddr_in addr4;
+  struct sockaddr *addr = (struct sockaddr *)&addr4;
+  socklen_t addr_len = sizeof(addr4);
+
+  if (family == AF_INET6) {
+    opt = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+
+    modbus_arch_memset(&addr6, 0, sizeof(addr6));
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_port = modbus_arch_htons(port);
+    addr6.sin6_addr = in6addr_any;
+    addr = (struct sockaddr *)&addr6;
+    addr_len = sizeof(addr6);
+  } else {
+    modbus_arch_memset(&addr4, 0, sizeof(addr4));
+    addr4.sin_family = AF_INET;
+    addr4.sin_port = modbus_arch_htons(port);
+    addr4.sin_addr.s_addr = INADDR_ANY;
+  }
+
+  if (bind(fd, addr, addr_len) < 0 || listen(fd, SOMAXCONN) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+bool modbus_server_init(modbus_server_t *s, uint16_t port, int max_conns) {
+  modbus_t *m = &s->modbus;
+
+  s->listen_fd = -1;
+  s->epoll_fd = -1;
+  s->max_conns = max_conns;
+  s->conns = 0;
+  s->idle = 0;
+  s->connections = 0;
+  s->accepted = 0;
+  s->closed = 0;
+  s->requests = 0;
+  s->deferred = 0;
+
+  s->listener.init = server_noop;
+  s->listener.kill = server_noop;
+
+  s->parser.decode = server_decode;
+  s->parser.encode = modbus_parser_socket.encode;
+
+  m->role = MODBUS_ROLE_SLAVE;
+  m->parser = &s->parser;
+  m->driver = &s->listener;
+  m->extra = 0;
+
+  // dual stack where the host has ipv6, ipv4 only otherwise
+  s->listen_fd = server_listen(AF_INET6, port);
+  if (s->listen_fd < 0) s->listen_fd = server_listen(AF_INET, port);
+  if (s->listen_fd < 0) goto on_error;
+
+  s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (s->epoll_fd < 0) goto on_error;
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = 0;
+  if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev) < 0) {
+    goto on_error;
+  }
+
+  int size = max_conns * sizeof(modbus_server_conn_t);
+  s->conns = modbus_arch_malloc(size);
+  if (!s->conns) goto on_error;
+  modbus_arch_memset(s->conns, 0, size);
+
+  for (int i = max_conns - 1; i >= 0; i--) {
+    modbus_server_conn_t *conn = &s->conns[i];
+    conn->driver.init = server_noop;
+    conn->driver.kill = server_noop;
+    conn->driver.recv = server_recv;
+    conn->driver.send = server_send;
+    conn->driver.cache = modbus_arch_malloc(MODBUS_SERVER_CACHE_SIZE);
+    if (!conn->driver.cache) goto on_error;
+    conn->driver.cache_len = MODBUS_SERVER_CACHE_SIZE;
+    modbus_buffer_init(&conn->driver.inbuf, MODBUS_SERVER_INBUF_SIZE);
+    modbus_buffer_init(&conn->outbuf, MODBUS_SERVER_OUTBUF_SIZE);
+    conn->fd = -1;
+    conn->server = s;
+    conn->next = s->idle;
+    s->idle = conn;
+  }
+
+  modbus_init(m);
+
+  s->mark.time = server_clock();
+  return true;
+on_error:
+  modbus_server_kill(s);
+  return false;
+}
+
+int modbus_server_poll(modbus_server_t *s, int timeout) {
+  struct epoll_event events[SERVER_EVENTS];
+
+  int count = epoll_wait(s->epoll_fd, events, SERVER_EVENTS, timeout);
+  for (int i = 0; i < count; i++) {
+    modbus_server_conn_t *conn = events[i].data.ptr;
+    if (!conn) {
+      server_accept(s);
+      continue;
+    }
+
+    // a flush may release requests held back in inbuf
+    bool serve = events[i].events & EPOLLIN;
+    if (events[i].events & EPOLLOUT) {
+      server_flush(conn);
+      serve = true;
+    }
+
+    // a half closed peer still gets the replies to what it sent
+    if (events[i].events & EPOLLRDHUP) {
+      conn->eof = true;
+      serve = true;
+    }
+
+    if (serve && !conn->closed) {
+      server_serve(s, conn);
+    }
+
+    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+      conn->closed = true;
+    }
+
+    if (conn->eof && !conn->closed) {
+      server_flush(conn);
+      if (modbus_buffer_is_empty(&conn->outbuf)) {
+        conn->closed = true;
+      }
+    }
+
+    if (!conn->closed) {
+      server_watch(s, conn);
+    }
+
+    if (conn->closed) {
+      server_close(s, conn);
+    }
+  }
+
+  return count;
+}
+
+void modbus_server_kill(modbus_server_t *s) {
+  if (s->conns) {
+    for (int i = 0; i < s->max_conns; i++) {
+      modbus_server_conn_t *conn = &s->conns[i];
+      if (conn->fd >= 0) {
+        close(conn->fd);
+      }
+      modbus_arch_free(conn->driver.cache);
+      modbus_buffer_kill(&conn->driver.inbuf);
+      modbus_buffer_kill(&conn->outbuf);
+    }
+
+    modbus_arch_free(s->conns);
+    s->conns = 0;
+    modbus_kill(&s->modbus);
+  }
+
+  if (s->epoll_fd >= 0) close(s->epoll_fd);
+  if (s->listen_fd >= 0) close(s->listen_fd);
+
+  s->epoll_fd = -1;
+  s->listen_fd = -1;
+  s->idle = 0;
+}
+
+void modbus_server_stats(modbus_server_t *s, modbus_server_stats_t *stats) {
+  uint64_t now = server_clock();
+  double elapsed = (now - s->mark.time) / 1e9;
+
+  stats->connections = s->connections;
+  stats->accepted = s->accepted;
+  stats->closed = s->closed;
+  stats->requests = s->requests;
+  stats->deferred = s->deferred;
+  stats->accepted_per_sec = 0;
+  stats->requests_per_sec = 0;
+
+  if (elapsed > 0) {
+    stats->accepted_per_sec = (s->accepted - s->mark.accepted) / elapsed;
+    stats->requests_per_sec = (s->requests - s->mark.requests) / elapsed;
+  }
+
+  s->mark.time = now;
+  s->mark.accepted = s->accepted;
+  s->mark.requests = s->requests;
+}
+
+#endif
\ No newline at end of file
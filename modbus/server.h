@@ -0,0 +1,84 @@
+#ifndef __MODBUS_SERVER_H__
+#define __MODBUS_SERVER_H__
+
+#include "define.h"
+
+// epoll based modbus tcp server, linux only
+
+#ifndef MODBUS_SERVER_CACHE_SIZE
+#define MODBUS_SERVER_CACHE_SIZE (260)
+#endif
+
+#ifndef MODBUS_SERVER_INBUF_SIZE
+#define MODBUS_SERVER_INBUF_SIZE (1024)
+#endif
+
+// replies the socket did not take wait here, a connection stops decoding
+// while less than one reply fits and is closed only if a reply cannot be
+// queued whole; a power of two
+#ifndef MODBUS_SERVER_OUTBUF_SIZE
+#define MODBUS_SERVER_OUTBUF_SIZE (4096)
+#endif
+
+typedef struct modbus_server_conn {
+  modbus_driver_socket_t driver;
+  modbus_mbap_t mbap;
+  modbus_buffer_t outbuf;
+  int fd;
+  int recv_len;
+  uint32_t events;
+  // the peer shut down its side, queued replies still go out
+  bool eof;
+  bool closed;
+  void *server;
+  struct modbus_server_conn *next;
+} modbus_server_conn_t;
+
+typedef struct {
+  int connections;
+  uint64_t accepted;
+  uint64_t closed;
+  uint64_t requests;
+  uint64_t deferred;
+  double accepted_per_sec;
+  double requests_per_sec;
+} modbus_server_stats_t;
+
+typedef struct {
+  // hooks, slave address and flags of this instance serve every connection,
+  // while a hook runs its driver and extra belong to the calling connection
+  modbus_t modbus;
+
+  int listen_fd;
+  int epoll_fd;
+  int max_conns;
+  // SO_SNDBUF of accepted sockets, 0 keeps the system default; set it
+  // before modbus_server_init
+  int send_buffer;
+  modbus_server_conn_t *conns;
+  modbus_server_conn_t *idle;
+  modbus_driver_t listener;
+  modbus_parser_t parser;
+
+  int connections;
+  uint64_t accepted;
+  uint64_t closed;
+  uint64_t requests;
+  // replies that went out through outbuf after the socket was full
+  uint64_t deferred;
+
+  struct {
+    uint64_t time;
+    uint64_t accepted;
+    uint64_t requests;
+  } mark;
+} modbus_server_t;
+
+bool modbus_server_init(modbus_server_t *s, uint16_t port, int max_conns);
+int modbus_server_poll(modbus_server_t *s, int timeout);
+void modbus_server_kill(modbus_server_t *s);
+
+// rates cover the time since the previous call
+void modbus_server_stats(modbus_server_t *s, modbus_server_stats_t *stats);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,154 @@
+#include "sim.h"
+
+#include "arch.h"
+#include "buffer.h"
+
+// xorshift32, deterministic for a given seed
+static uint32_t sim_random(modbus_sim_t* sim) {
+  uint32_t x = sim->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  sim->rng = x;
+  return x;
+}
+
+static bool sim_odds(modbus_sim_t* sim, uint32_t ppm) {
+  return ppm && sim_random(sim) % 1000000 < ppm;
+}
+
+static void sim_port_init(void* this) {
+  modbus_sim_port_t* port = this;
+  modbus_buffer_init(&port->driver.inbuf, MODBUS_SIM_BUFFER_SIZE);
+  modbus_buffer_init(&port->driver.oubuf, MODBUS_SIM_BUFFER_SIZE);
+}
+
+static void sim_port_kill(void* this) {
+  modbus_sim_port_t* port = this;
+  modbus_buffer_kill(&port->driver.inbuf);
+  modbus_buffer_kill(&port->driver.oubuf);
+}
+
+static int sim_port_recv(void* this, uint8_t* buf, int max) {
+  modbus_sim_port_t* port = this;
+  modbus_sim_t* sim = port->sim;
+
+  int len = 0;
+  while (len < max && port->count) {
+    modbus_sim_byte_t* byte = &port->queue[port->head];
+    if (byte->at > sim->now) break;
+
+    buf[len++] = byte->raw;
+    port->last = byte->at;
+    port->head = (port->head + 1) % MODBUS_SIM_QUEUE;
+    port->count--;
+  }
+
+  port->received += len;
+  return len;
+}
+
+static uint32_t sim_port_silence(void* this) {
+  modbus_sim_port_t* port = this;
+
+  uint64_t silence = port->sim->now - port->last;
+  return silence > UINT32_MAX ? UINT32_MAX : silence;
+}
+
+static int sim_port_send(void* this, uint8_t* buf, int len) {
+  modbus_sim_port_t* port = this;
+  modbus_sim_port_t* peer = port->peer;
+  modbus_sim_t* sim = port->sim;
+  uint32_t char_time = modbus_sim_char_time(sim);
+
+  for (int i = 0; i < len; i++) {
+    // the uart shifts bytes out back to back once the line is free
+    uint64_t start = sim->busy_until;
+    if (start < sim->now) start = sim->now;
+
+    if (sim_odds(sim, sim->config.gap_ppm)) {
+      start += sim->config.gap_us;
+    }
+
+    sim->busy_until = start + char_time;
+    sim->busy += char_time;
+    port->sent++;
+
+    bool drop = sim_odds(sim, sim->config.drop_ppm);
+    if (drop || peer->count == MODBUS_SIM_QUEUE) {
+      peer->dropped++;
+      continue;
+    }
+
+    uint8_t raw = buf[i];
+    if (sim_odds(sim, sim->config.noise_ppm)) {
+      raw ^= 1 << (sim_random(sim) % 8);
+      peer->corrupted++;
+    }
+
+    modbus_sim_byte_t* byte =
+        &peer->queue[(peer->head + peer->count) % MODBUS_SIM_QUEUE];
+    byte->raw = raw;
+    byte->at = sim->busy_until;
+    peer->count++;
+  }
+
+  return len;
+}
+
+static void sim_port_setup(modbus_sim_t* sim, modbus_sim_port_t* port,
+                           modbus_sim_port_t* peer) {
+  modbus_arch_memset(port, 0, sizeof(modbus_sim_port_t));
+
+  port->driver.init = sim_port_init;
+  port->driver.kill = sim_port_kill;
+  port->driver.recv = sim_port_recv;
+  port->driver.send = sim_port_send;
+  port->driver.silence = sim_port_silence;
+  port->driver.baud = sim->config.baud;
+  port->sim = sim;
+  port->peer = peer;
+}
+
+void modbus_sim_init(modbus_sim_t* sim, modbus_sim_config_t* config) {
+  modbus_arch_memcpy(&sim->config, config, sizeof(modbus_sim_config_t));
+
+  if (sim->config.baud == 0) sim->config.baud = 9600;
+  if (sim->config.stop_bits == 0) sim->config.stop_bits = 1;
+
+  sim_port_setup(sim, &sim->a, &sim->b);
+  sim_port_setup(sim, &sim->b, &sim->a);
+
+  sim->now = 0;
+  sim->busy_until = 0;
+  sim->busy = 0;
+  sim->rng = config->seed ? config->seed : 1;
+}
+
+uint32_t modbus_sim_char_time(modbus_sim_t* sim) {
+  modbus_sim_config_t* config = &sim->config;
+
+  uint32_t bits = 1 + 8 + config->stop_bits;
+  if (config->parity != MODBUS_SIM_PARITY_NONE) {
+    bits++;
+  }
+
+  return (bits * 1000000 + config->baud - 1) / config->baud;
+}
+
+void modbus_sim_advance(modbus_sim_t* sim, uint32_t us) { sim->now += us; }
+
+uint32_t modbus_sim_millis(modbus_sim_t* sim) { return sim->now / 1000; }
+
+void modbus_sim_stats(modbus_sim_t* sim, modbus_sim_stats_t* stats) {
+  stats->now = sim->now;
+  stats->busy = sim->busy;
+  stats->bytes = sim->a.sent + sim->b.sent;
+  stats->dropped = sim->a.dropped + sim->b.dropped;
+  stats->corrupted = sim->a.corrupted + sim->b.corrupted;
+  stats->utilization = 0;
+
+  if (sim->now > 0) {
+    stats->utilization = (double)sim->busy / sim->now;
+  }
+}
\ No newline at end of file
@@ -0,0 +1,91 @@
+#ifndef __MODBUS_SIM_H__
+#define __MODBUS_SIM_H__
+
+#include "define.h"
+
+// simulated serial line joining two rtu drivers, time is virtual and only
+// moves with modbus_sim_advance so runs are fast and repeatable
+
+#ifndef MODBUS_SIM_QUEUE
+#define MODBUS_SIM_QUEUE (512)
+#endif
+
+#ifndef MODBUS_SIM_BUFFER_SIZE
+#define MODBUS_SIM_BUFFER_SIZE (256)
+#endif
+
+#define MODBUS_SIM_PARITY_NONE (0)
+#define MODBUS_SIM_PARITY_ODD (1)
+#define MODBUS_SIM_PARITY_EVEN (2)
+
+typedef struct {
+  uint32_t baud;
+  uint8_t parity;
+  uint8_t stop_bits;
+
+  // fault odds per byte in parts per million, drawn from seed
+  uint32_t noise_ppm;
+  uint32_t drop_ppm;
+  uint32_t gap_ppm;
+  // silence inserted before a byte hit by a gap
+  uint32_t gap_us;
+  uint32_t seed;
+} modbus_sim_config_t;
+
+typedef struct {
+  uint8_t raw;
+  uint64_t at;
+} modbus_sim_byte_t;
+
+typedef struct modbus_sim_port {
+  // first member, the port is handed to modbus_t as its driver
+  modbus_driver_rtu_t driver;
+  struct modbus_sim *sim;
+  struct modbus_sim_port *peer;
+
+  // bytes on their way to this port with their arrival time
+  modbus_sim_byte_t queue[MODBUS_SIM_QUEUE];
+  int head;
+  int count;
+
+  // arrival time of the last byte handed to the driver
+  uint64_t last;
+
+  uint64_t sent;
+  uint64_t received;
+  uint64_t dropped;
+  uint64_t corrupted;
+} modbus_sim_port_t;
+
+typedef struct modbus_sim {
+  modbus_sim_config_t config;
+  modbus_sim_port_t a;
+  modbus_sim_port_t b;
+
+  // microseconds, the line is half duplex and free again at busy_until
+  uint64_t now;
+  uint64_t busy_until;
+  uint64_t busy;
+  uint32_t rng;
+} modbus_sim_t;
+
+typedef struct {
+  uint64_t now;
+  uint64_t busy;
+  uint64_t bytes;
+  uint64_t dropped;
+  uint64_t corrupted;
+  double utilization;
+} modbus_sim_stats_t;
+
+void modbus_sim_init(modbus_sim_t* sim, modbus_sim_config_t* config);
+
+// microseconds on the wire for one character with start, parity and stop
+uint32_t modbus_sim_char_time(modbus_sim_t* sim);
+
+void modbus_sim_advance(modbus_sim_t* sim, uint32_t us);
+uint32_t modbus_sim_millis(modbus_sim_t* sim);
+
+void modbus_sim_stats(modbus_sim_t* sim, modbus_sim_stats_t* stats);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,23 @@
+#include "stats.h"
+
+#if defined(MODBUS_STATS)
+
+void modbus_stats_record(uint32_t* histogram, uint32_t us) {
+  int bucket = 0;
+  while (us && bucket < MODBUS_STATS_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+
+  histogram[bucket]++;
+}
+
+void modbus_stats_snapshot(modbus_t* m, modbus_stats_t* stats) {
+  modbus_arch_memcpy(stats, &m->stats, sizeof(modbus_stats_t));
+}
+
+void modbus_stats_reset(modbus_t* m) {
+  modbus_arch_memset(&m->stats, 0, sizeof(modbus_stats_t));
+}
+
+#endif
\ No newline at end of file
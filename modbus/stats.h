@@ -0,0 +1,28 @@
+#ifndef __MODBUS_STATS_H__
+#define __MODBUS_STATS_H__
+
+#include "arch.h"
+#include "define.h"
+
+// counters and latency histograms, built only with MODBUS_STATS defined;
+// without it the macros below compile to nothing
+
+#if defined(MODBUS_STATS)
+
+#define MODBUS_STATS_ADD(s, field, n) \
+  do {                                \
+    if (s) (s)->field += (n);         \
+  } while (0)
+
+void modbus_stats_record(uint32_t* histogram, uint32_t us);
+
+void modbus_stats_snapshot(modbus_t* m, modbus_stats_t* stats);
+void modbus_stats_reset(modbus_t* m);
+
+#else
+
+#define MODBUS_STATS_ADD(s, field, n) ((void)0)
+
+#endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,91 @@
+#include "swap.h"
+
+#if !defined(MODBUS_SWAP_SCALAR) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SWAP_X86 1
+#include <immintrin.h>
+#else
+#define SWAP_X86 0
+#endif
+
+#if SWAP_X86
+static void swap16_scalar(uint8_t* dst, uint8_t* src, int count) {
+  for (int i = 0; i < count; i++) {
+    uint8_t hi = src[i * 2];
+    uint8_t lo = src[i * 2 + 1];
+    dst[i * 2] = lo;
+    dst[i * 2 + 1] = hi;
+  }
+}
+
+__attribute__((target("ssse3"))) static void swap16_ssse3(uint8_t* dst,
+                                                          uint8_t* src,
+                                                          int count) {
+  const __m128i shuffle =
+      _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+  for (; count >= 8; count -= 8) {
+    __m128i v = _mm_loadu_si128((__m128i*)src);
+    _mm_storeu_si128((__m128i*)dst, _mm_shuffle_epi8(v, shuffle));
+    src += 16;
+    dst += 16;
+  }
+
+  swap16_scalar(dst, src, count);
+}
+
+__attribute__((target("avx2"))) static void swap16_avx2(uint8_t* dst,
+                                                        uint8_t* src,
+                                                        int count) {
+  const __m256i shuffle = _mm256_setr_epi8(
+      1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4,
+      7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+  for (; count >= 16; count -= 16) {
+    __m256i v = _mm256_loadu_si256((__m256i*)src);
+    _mm256_storeu_si256((__m256i*)dst, _mm256_shuffle_epi8(v, shuffle));
+    src += 32;
+    dst += 32;
+  }
+
+  swap16_ssse3(dst, src, count);
+}
+
+static void swap16_detect(uint8_t* dst, uint8_t* src, int count);
+static void (*swap16)(uint8_t*, uint8_t*, int) = swap16_detect;
+
+static void swap16_detect(uint8_t* dst, uint8_t* src, int count) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    swap16 = swap16_avx2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    swap16 = swap16_ssse3;
+  } else {
+    swap16 = swap16_scalar;
+  }
+
+  swap16(dst, src, count);
+}
+#endif
+
+void modbus_swap16_load(uint16_t* dst, uint8_t* src, int count) {
+#if SWAP_X86
+  swap16((uint8_t*)dst, src, count);
+#else
+  for (int i = 0; i < count; i++) {
+    dst[i] = (src[i * 2] << 8) | src[i * 2 + 1];
+  }
+#endif
+}
+
+void modbus_swap16_store(uint8_t* dst, uint16_t* src, int count) {
+#if SWAP_X86
+  swap16(dst, (uint8_t*)src, count);
+#else
+  for (int i = 0; i < count; i++) {
+    uint16_t val = src[i];
+    dst[i * 2] = val >> 8;
+    dst[i * 2 + 1] = val & 0xFF;
+  }
+#endif
+}
\ No newline at end of file
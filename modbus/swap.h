@@ -0,0 +1,11 @@
+#ifndef __MODBUS_SWAP_H__
+#define __MODBUS_SWAP_H__
+
+#include "inttypes.h"
+
+// big endian register blocks to and from host order, dst may alias src
+// or start below it
+void modbus_swap16_load(uint16_t* dst, uint8_t* src, int count);
+void modbus_swap16_store(uint8_t* dst, uint16_t* src, int count);
+
+#endif
\ No newline at end of file